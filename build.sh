@@ -1,7 +1,9 @@
+DYNAMORIO_ROOT=$(realpath "${DYNAMORIO_ROOT:-../Libs/DynamoRIO-AArch64-Linux-9.0.1}")
 clang testPrograms/basicMultiThread.c -o basicMultiThread.elf -lpthread
+clang testPrograms/mixedWidthAccesses.c -o mixedWidthAccesses.elf -lpthread
 mkdir build
 rm build/libmyclient.so
 cd build
-cmake ../
+cmake -DDYNAMORIO_ROOT="$DYNAMORIO_ROOT" ../
 make
-cd ../
\ No newline at end of file
+cd ../
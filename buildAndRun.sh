@@ -1,2 +1,3 @@
+export DYNAMORIO_ROOT=${DYNAMORIO_ROOT:-../Libs/DynamoRIO-AArch64-Linux-9.0.1}
 bash build.sh
-../Libs//DynamoRIO-AArch64-Linux-9.0.1/bin64/drrun -c build/libmyclient.so -- basicMultiThread.elf -lpthread
\ No newline at end of file
+$DYNAMORIO_ROOT/bin64/drrun -c build/libmyclient.so -- basicMultiThread.elf -lpthread
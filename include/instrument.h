@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h> /* for offsetof */
 #include <string.h>
 #include <pthread.h>
 #include<sys/wait.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include "dr_api.h"
 #include "drmgr.h"
@@ -14,14 +16,22 @@
 #include "drsyms.h"
 
 #include "types.h"
+#include "report.h"
+#include "symcache.h"
 
 #define SYS_MAX_ARGS 3
 #define TLS_SLOT(tls_base, enum_val) (void **)((byte *)(tls_base) + tls_offs + (enum_val))
 #define BUF_PTR(tls_base) *(mem_ref_t **)TLS_SLOT(tls_base, MEMTRACE_TLS_OFFS_BUF_PTR)
+#define BUF_END(tls_base) *(mem_ref_t **)TLS_SLOT(tls_base, MEMTRACE_TLS_OFFS_BUF_END)
 
 enum {
     REF_TYPE_READ = 0,
     REF_TYPE_WRITE = 1,
+    /* Atomic, exclusive or acquire/release accesses. They are sync events carrying
+     * happens-before edges, not racy accesses. The values are far above any opcode.
+     */
+    REF_TYPE_SYNC_ACQUIRE = 0xfffe,
+    REF_TYPE_SYNC_RELEASE = 0xffff,
 };
 /* Each mem_ref_t is a <type, size, addr> entry representing a memory reference
  * instruction or the reference information, e.g.:
@@ -34,17 +44,25 @@ typedef struct _mem_ref_t {
     app_pc addr; /* mem ref addr or instr pc */
 } mem_ref_t;
 
-/* Max number of mem_ref a buffer can have. It should be big enough
- * to hold all entries between clean calls.
+/* Default number of mem_refs a buffer starts with (-buf_entries). Buffers of threads
+ * flushing often grow up to -max_buf_entries.
  */
 #define MAX_NUM_MEM_REFS 4096
-/* The maximum size of buffer for holding mem_refs. */
-#define MEM_BUF_SIZE (sizeof(mem_ref_t) * MAX_NUM_MEM_REFS)
+#define MAX_NUM_MEM_REFS_GROWN (MAX_NUM_MEM_REFS * 256)
+/* The buffer is flushed once fewer than this many entries are left. It must hold all
+ * entries added between two buffer checks.
+ */
+#define MAX_REFS_BETWEEN_CHECKS 64
 
 /* thread private log file and counter */
 typedef struct {
     byte *seg_base;
     mem_ref_t *buf_base;
+    size_t buf_size;         /* in bytes */
+    byte *buf_alloc;         /* dr_raw_mem_alloc'ed, buf_base is aligned within it */
+    size_t buf_alloc_size;
+    uint64 window_start_ms;  /* start of the current flush rate window */
+    uint num_window_flushes; /* buffer full flushes in the current window */
     file_t log;
     FILE *logf;
     uint64 num_refs;
@@ -53,10 +71,11 @@ typedef struct {
     bool repeat;
 } per_thread_t;
 
-/* Allocated TLS slot offsets */
+/* Allocated TLS slot offsets (in bytes) */
 enum {
-    MEMTRACE_TLS_OFFS_BUF_PTR,
-    MEMTRACE_TLS_COUNT, /* total number of TLS slots allocated */
+    MEMTRACE_TLS_OFFS_BUF_PTR = 0,
+    MEMTRACE_TLS_OFFS_BUF_END = sizeof(void *), /* flush threshold of the buffer */
+    MEMTRACE_TLS_COUNT = 2, /* total number of TLS slots allocated */
 };
 
 int tls_idx;
@@ -67,9 +86,14 @@ int num_syscalls;
 extern void memtrace(void *drcontext, u64 thread_id);
 extern u32 mem_analyse_init();
 extern void mem_analyse_exit();
-extern void mem_analyse_thread_exit();
+extern void mem_analyse_thread_exit(void *drcontext);
 extern u32 mem_analyse_new_thread_init(void *drcontext);
 extern void wrap_pre_unlock(void *wrapcxt, OUT void **user_data);
 extern void wrap_pre_lock(void *wrapcxt, OUT void **user_data);
 extern void wrap_post_malloc(void *wrapcxt, void *user_data);
-extern void wrap_pre_malloc(void *wrapcxt, OUT void **user_data);
\ No newline at end of file
+extern void wrap_pre_malloc(void *wrapcxt, OUT void **user_data);
+
+/* implemented by instrument.c */
+bool watch_allocation(void *wrapcxt, size_t size);
+bool race_is_suppressed(app_pc pc, app_pc other_pc);
+void shrink_idle_trace_buf(void *drcontext);
\ No newline at end of file
@@ -0,0 +1,26 @@
+#include "types.h"
+
+typedef enum RaceKind {
+    WriteReadRace = 0,
+    WriteWriteRace = 1,
+} RaceKind;
+
+// fixed size record handed from the detecting thread to the report writer thread,
+// formatting and I/O happen on the writer thread only
+typedef struct RaceReport {
+    RaceKind kind;
+    u64 address;
+    u64 size;
+    u64 pc;
+    u64 other_pc;
+    u16 opcode;
+    u16 other_opcode;
+    u64 thread_id;
+    u64 other_thread_id;
+    u64 memory_access_count;
+    u64 other_memory_access_count;
+} RaceReport;
+
+extern bool report_init(const char *path);
+extern void report_exit();
+extern void report_race(const RaceReport *report);
@@ -0,0 +1,12 @@
+#include "types.h"
+
+// offset reported for symbols that aren't defined by the module
+#define SYMCACHE_NOT_FOUND ((size_t)-1)
+
+extern bool symcache_init(const char *dir);
+extern void symcache_exit();
+extern void symcache_lookup(const module_data_t *mod, const char **names, u32 n_names, size_t *offsets);
+// cached module relative [start, end) ranges computed from the given rules. on a hit add is
+// called for every range and true returned, on a miss the caller computes and stores them.
+extern bool symcache_load_ranges(const module_data_t *mod, const char **rules, u32 n_rules, void (*add)(size_t start, size_t end, void *data), void *data);
+extern void symcache_store_ranges(const module_data_t *mod, const char **rules, u32 n_rules, const size_t *ranges, u64 n_ranges);
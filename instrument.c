@@ -8,6 +8,47 @@ static reg_id_t tls_seg;
 
 #define MINSERT instrlist_meta_preinsert
 
+/* nudge arguments accepted by event_nudge (drnudgeunix -client <id> <arg>) */
+enum {
+    NUDGE_TOGGLE_INSTRUMENTATION = 0,
+    NUDGE_ENABLE_INSTRUMENTATION = 1,
+    NUDGE_DISABLE_INSTRUMENTATION = 2,
+};
+
+/* client options, set once by parse_options before any thread is running */
+static bool op_start_disabled;   /* -start_disabled */
+static uint op_enable_after_ms;  /* -enable_after_ms <ms> */
+static uint op_window_ms;        /* -window_ms <ms> */
+static const char *op_report_file; /* -report_file <path> */
+static const char *op_symcache_dir; /* -symcache_dir <dir> */
+static const char *op_suppress_file; /* -suppress <path> */
+static uint op_buf_entries = MAX_NUM_MEM_REFS;           /* -buf_entries <n> */
+static uint op_max_buf_entries = MAX_NUM_MEM_REFS_GROWN; /* -max_buf_entries <n> */
+static bool op_huge_pages;       /* -huge_pages */
+
+#define MAX_SCOPE_PATTERNS 64
+#define MAX_OPTION_LEN 4096
+/* -only_modules <name,...> and -only_functions <glob,...>, both split on ',' */
+static char op_only_modules[MAX_OPTION_LEN];
+static char op_only_functions[MAX_OPTION_LEN];
+static const char *scope_module_patterns[MAX_SCOPE_PATTERNS];
+static int n_scope_module_patterns;
+static const char *scope_function_patterns[MAX_SCOPE_PATTERNS];
+static int n_scope_function_patterns;
+
+/* allocation watch filter: -watch_min_size <n>, -watch_max_size <n>, -watch_callers <glob,...> */
+static u64 op_watch_min_size;
+static u64 op_watch_max_size;
+static char op_watch_callers[MAX_OPTION_LEN];
+static const char *watch_caller_patterns[MAX_SCOPE_PATTERNS];
+static int n_watch_caller_patterns;
+
+/* Read once per basic block by event_bb_analysis. Blocks built while this is false
+ * get no memory reference instrumentation and run at near native speed.
+ */
+static volatile bool instrumentation_enabled = true;
+static void *toggle_mutex;
+
 static void
 print_qualified_function_name(app_pc pc)
 {
@@ -37,39 +78,745 @@ print_qualified_function_name(app_pc pc)
     dr_free_module_data(mod);
 }
 
+/* Sorted set of [start, end) pc ranges, resolved once per module at load time so the
+ * bb events only need a binary search.
+ */
+#define MAX_PC_RANGES 65536
+typedef struct _pc_range_t {
+    app_pc start;
+    app_pc end;
+} pc_range_t;
+
+typedef struct _pc_range_set_t {
+    const char *name;
+    pc_range_t ranges[MAX_PC_RANGES];
+    int n_ranges;
+    void *lock;
+} pc_range_set_t;
+
+/* Instrumentation scope: if any -only_* list is given, only blocks starting inside one
+ * of these ranges get instrumented.
+ */
+static pc_range_set_t scope_ranges = { "scope" };
+
+static bool scope_restricted(void) {
+    return n_scope_module_patterns > 0 || n_scope_function_patterns > 0;
+}
+
+/* minimal glob matching supporting '*' and '?' */
+static bool glob_match(const char *pattern, const char *str) {
+    if (*pattern == '\0')
+        return *str == '\0';
+    if (*pattern == '*')
+        return glob_match(pattern + 1, str) || (*str != '\0' && glob_match(pattern, str + 1));
+    if (*str == '\0')
+        return false;
+    if (*pattern == '?' || *pattern == *str)
+        return glob_match(pattern + 1, str + 1);
+    return false;
+}
+
+/* Overlapping ranges (e.g. a function inside an already added module, nested symbols)
+ * are merged, so the ranges stay disjoint and sorted by both start and end, which the
+ * binary search in range_set_contains relies on. Merely adjacent ranges are kept apart,
+ * they may belong to different modules.
+ */
+static void range_set_add(pc_range_set_t *set, app_pc start, app_pc end) {
+    int lo, hi;
+    dr_rwlock_write_lock(set->lock);
+    /* first range ending after start */
+    for (lo = 0; lo < set->n_ranges && set->ranges[lo].end <= start; lo++)
+        ;
+    /* [lo, hi) overlap the new range and are replaced by their union */
+    for (hi = lo; hi < set->n_ranges && set->ranges[hi].start < end; hi++) {
+        if (set->ranges[hi].start < start)
+            start = set->ranges[hi].start;
+        if (set->ranges[hi].end > end)
+            end = set->ranges[hi].end;
+    }
+    if (hi == lo && set->n_ranges >= MAX_PC_RANGES) {
+        dr_rwlock_write_unlock(set->lock);
+        dr_fprintf(STDERR, "%s range table full, ignoring %p-%p\n", set->name, start, end);
+        return;
+    }
+    memmove(&set->ranges[lo + 1], &set->ranges[hi],
+            (set->n_ranges - hi) * sizeof(set->ranges[0]));
+    set->ranges[lo].start = start;
+    set->ranges[lo].end = end;
+    set->n_ranges += 1 - (hi - lo);
+    dr_rwlock_write_unlock(set->lock);
+}
+
+static void range_set_remove_module(pc_range_set_t *set, const module_data_t *mod) {
+    int i, j = 0;
+    dr_rwlock_write_lock(set->lock);
+    for (i = 0; i < set->n_ranges; i++) {
+        if (set->ranges[i].start >= mod->start && set->ranges[i].start < mod->end)
+            continue;
+        set->ranges[j++] = set->ranges[i];
+    }
+    set->n_ranges = j;
+    dr_rwlock_write_unlock(set->lock);
+}
+
+static bool range_set_contains(pc_range_set_t *set, app_pc pc) {
+    int lo = 0, hi, mid;
+    bool found = false;
+    dr_rwlock_read_lock(set->lock);
+    hi = set->n_ranges - 1;
+    /* find the last range starting at or below pc */
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (set->ranges[mid].start <= pc)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    if (hi >= 0 && pc < set->ranges[hi].end)
+        found = true;
+    dr_rwlock_read_unlock(set->lock);
+    return found;
+}
+
+static bool pc_in_scope(app_pc pc) {
+    if (!scope_restricted())
+        return true;
+    return range_set_contains(&scope_ranges, pc);
+}
+
+/* drsym_enumerate_symbols_ex callback adding every function matching one of the
+ * patterns to the range set
+ */
+typedef struct _range_search_t {
+    const module_data_t *mod;
+    pc_range_set_t *set;
+    const char **patterns;
+    int n_patterns;
+} range_search_t;
+
+static bool range_set_add_function(drsym_info_t *info, drsym_error_t status, void *data) {
+    range_search_t *search = (range_search_t *)data;
+    int i;
+    if (info->name == NULL || info->end_offs <= info->start_offs)
+        return true; /* keep iterating */
+    for (i = 0; i < search->n_patterns; i++) {
+        if (glob_match(search->patterns[i], info->name)) {
+            range_set_add(search->set, search->mod->start + info->start_offs,
+                          search->mod->start + info->end_offs);
+            break;
+        }
+    }
+    return true;
+}
+
+/* Adds all functions of mod matching one of the patterns, walking the symbol table once
+ * for all of them. drsym_search_symbols_ex only exists for PDBs, so the names are
+ * matched here instead.
+ */
+static void range_set_add_functions(pc_range_set_t *set, const module_data_t *mod,
+                                    const char **patterns, int n_patterns) {
+    range_search_t search = { mod, set, patterns, n_patterns };
+    drsym_error_t res;
+    if (n_patterns == 0)
+        return;
+    res = drsym_enumerate_symbols_ex(mod->full_path, range_set_add_function,
+                                     sizeof(drsym_info_t), &search, DRSYM_DEMANGLE);
+    if (res != DRSYM_SUCCESS)
+        dr_fprintf(STDERR, "unable to enumerate symbols of %s (error %d), no %s functions\n",
+                   mod->full_path, res, set->name);
+}
+
+static void scope_resolve_module(const module_data_t *mod) {
+    int i;
+    const char *name = dr_module_preferred_name(mod);
+    if (name != NULL) {
+        for (i = 0; i < n_scope_module_patterns; i++) {
+            if (glob_match(scope_module_patterns[i], name)) {
+                range_set_add(&scope_ranges, mod->start, mod->end);
+                /* the whole module is in scope, function ranges would be redundant */
+                return;
+            }
+        }
+    }
+    range_set_add_functions(&scope_ranges, mod, scope_function_patterns,
+                            n_scope_function_patterns);
+}
+
+/* Max number of frames walked above the wrapped allocation function when matching
+ * -watch_callers.
+ */
+#define MAX_WATCH_FRAMES 16
+/* Symbolizing a whole callstack on every allocation is expensive, so the result per
+ * callstack is cached. The key hashes all walked frames, since any of them can decide
+ * the match. Stacks are hashed into a direct mapped table, collisions simply evict.
+ */
+#define WATCH_SITE_CACHE_SIZE 4096
+typedef struct _watch_site_t {
+    uint64 stack_hash;
+    bool matches;
+} watch_site_t;
+
+static watch_site_t watch_site_cache[WATCH_SITE_CACHE_SIZE];
+static void *watch_site_mutex;
+
+static bool pc_matches_watch_callers(app_pc pc) {
+    module_data_t *mod = dr_lookup_module(pc);
+    drsym_info_t sym_info;
+    char name[MAX_FUNC_LEN];
+    bool matches = false;
+    int i;
+    if (mod == NULL)
+        return false;
+    sym_info.struct_size = sizeof(sym_info);
+    sym_info.name = name;
+    sym_info.name_size = MAX_FUNC_LEN;
+    sym_info.file = NULL;
+    sym_info.file_size = 0;
+    if (drsym_lookup_address(mod->full_path, pc - mod->start, &sym_info, DRSYM_DEMANGLE) ==
+        DRSYM_SUCCESS) {
+        for (i = 0; i < n_watch_caller_patterns && !matches; i++)
+            matches = glob_match(watch_caller_patterns[i], sym_info.name);
+    }
+    dr_free_module_data(mod);
+    return matches;
+}
+
+static bool callstack_matches_watch_callers(void *wrapcxt) {
+    dr_mcontext_t *mc = drwrap_get_mcontext(wrapcxt);
+    drcallstack_walk_t *walk;
+    drcallstack_frame_t frame = { sizeof(frame) };
+    app_pc frames[MAX_WATCH_FRAMES];
+    /* FNV-1a over the frame pcs, never 0 so empty slots don't match */
+    uint64 stack_hash = 14695981039346656037ULL;
+    watch_site_t *cached;
+    bool matches = false;
+    int n_frames = 0, i;
+
+    if (drcallstack_init_walk(mc, &walk) != DRCALLSTACK_SUCCESS)
+        return false;
+    /* the first frame is the wrapped allocation function itself */
+    if (drcallstack_next_frame(walk, &frame) == DRCALLSTACK_SUCCESS) {
+        while (n_frames < MAX_WATCH_FRAMES &&
+               drcallstack_next_frame(walk, &frame) == DRCALLSTACK_SUCCESS)
+            frames[n_frames++] = frame.pc;
+    }
+    drcallstack_cleanup_walk(walk);
+    for (i = 0; i < n_frames; i++)
+        stack_hash = (stack_hash ^ (uint64)(ptr_uint_t)frames[i]) * 1099511628211ULL;
+    stack_hash |= 1;
+    cached = &watch_site_cache[(stack_hash >> 12) % WATCH_SITE_CACHE_SIZE];
+
+    dr_mutex_lock(watch_site_mutex);
+    if (cached->stack_hash == stack_hash) {
+        matches = cached->matches;
+        dr_mutex_unlock(watch_site_mutex);
+        return matches;
+    }
+    dr_mutex_unlock(watch_site_mutex);
+
+    for (i = 0; i < n_frames && !matches; i++)
+        matches = pc_matches_watch_callers(frames[i]);
+
+    dr_mutex_lock(watch_site_mutex);
+    cached->stack_hash = stack_hash;
+    cached->matches = matches;
+    dr_mutex_unlock(watch_site_mutex);
+    return matches;
+}
+
+/* Called by the allocation wrapper before an allocation gets tracked. Allocations not
+ * passing the -watch_* filter never enter the allocation index, so accesses to them
+ * fall off memtrace's fast path.
+ */
+bool watch_allocation(void *wrapcxt, size_t size) {
+    if (op_watch_min_size > 0 && size < op_watch_min_size)
+        return false;
+    if (op_watch_max_size > 0 && size > op_watch_max_size)
+        return false;
+    if (n_watch_caller_patterns > 0)
+        return callstack_matches_watch_callers(wrapcxt);
+    return true;
+}
+
+/* Suppression rules read from the -suppress file, one per line ('#' starts a comment):
+ *   module:<glob>            all code of matching modules
+ *   function:<glob>          all matching functions
+ *   file:[<mod glob>!]<glob> all functions with code from matching source files, only
+ *                            looked for in modules matching <mod glob> if given
+ *   race:<mod>+<offs>,<mod>+<offs>   a race between the accesses at these two pcs
+ * Module, function and file rules are compiled into suppressed_ranges at module load
+ * and blocks starting inside them are not instrumented. All function rules share one
+ * walk over the module's symbols and all file rules one walk over its line table, whose
+ * result is kept in the symbol cache. Race rules are resolved to
+ * absolute pc pairs once both modules are loaded and checked in O(1) through a hash set
+ * when a race is found.
+ */
+#define MAX_SUPPRESS_RULES 1024
+#define MAX_SUPPRESS_PATTERN_LEN 256
+#define SUPPRESSED_RACES_SIZE 4096 /* power of 2, more than twice MAX_SUPPRESS_RULES */
+
+typedef enum {
+    SUPPRESS_MODULE,
+    SUPPRESS_FUNCTION,
+    SUPPRESS_FILE,
+    SUPPRESS_RACE,
+} suppress_kind_t;
+
+typedef struct _suppress_rule_t {
+    suppress_kind_t kind;
+    char pattern[MAX_SUPPRESS_PATTERN_LEN];
+    /* file rules only, empty for all modules */
+    char module_pattern[MAX_SUPPRESS_PATTERN_LEN];
+    /* race rules only */
+    char race_module[2][MAX_SUPPRESS_PATTERN_LEN];
+    size_t race_offs[2];
+    app_pc race_pc[2];
+} suppress_rule_t;
+
+typedef struct _pc_pair_t {
+    app_pc lo;
+    app_pc hi;
+} pc_pair_t;
+
+static suppress_rule_t suppress_rules[MAX_SUPPRESS_RULES];
+static int n_suppress_rules;
+static const char *suppress_function_patterns[MAX_SUPPRESS_RULES];
+static int n_suppress_function_patterns;
+static pc_range_set_t suppressed_ranges = { "suppression" };
+static pc_pair_t suppressed_races[SUPPRESSED_RACES_SIZE];
+static void *suppress_mutex;
+
+/* like pc_in_scope, checked once per block by event_bb_analysis */
+static bool pc_suppressed(app_pc pc) {
+    return n_suppress_rules > 0 && range_set_contains(&suppressed_ranges, pc);
+}
+
+static bool parse_race_pc(const char *str, char *module, size_t *offs) {
+    const char *plus = strrchr(str, '+');
+    if (plus == NULL || plus == str || plus - str >= MAX_SUPPRESS_PATTERN_LEN)
+        return false;
+    memcpy(module, str, plus - str);
+    module[plus - str] = '\0';
+    *offs = (size_t)strtoull(plus + 1, NULL, 0);
+    return true;
+}
+
+static bool parse_suppress_line(char *line, suppress_rule_t *rule) {
+    char *value = strchr(line, ':');
+    char *comma;
+    if (value == NULL)
+        return false;
+    *value++ = '\0';
+    memset(rule, 0, sizeof(*rule));
+    if (strcmp(line, "module") == 0)
+        rule->kind = SUPPRESS_MODULE;
+    else if (strcmp(line, "function") == 0)
+        rule->kind = SUPPRESS_FUNCTION;
+    else if (strcmp(line, "file") == 0)
+        rule->kind = SUPPRESS_FILE;
+    else if (strcmp(line, "race") == 0)
+        rule->kind = SUPPRESS_RACE;
+    else
+        return false;
+    if (rule->kind == SUPPRESS_FILE) {
+        char *bang = strchr(value, '!');
+        if (bang != NULL) {
+            if (bang - value >= MAX_SUPPRESS_PATTERN_LEN)
+                return false;
+            memcpy(rule->module_pattern, value, bang - value);
+            rule->module_pattern[bang - value] = '\0';
+            value = bang + 1;
+        }
+    }
+    if (rule->kind != SUPPRESS_RACE) {
+        if (strlen(value) >= MAX_SUPPRESS_PATTERN_LEN)
+            return false;
+        strcpy(rule->pattern, value);
+        return true;
+    }
+    comma = strchr(value, ',');
+    if (comma == NULL)
+        return false;
+    *comma = '\0';
+    return parse_race_pc(value, rule->race_module[0], &rule->race_offs[0]) &&
+        parse_race_pc(comma + 1, rule->race_module[1], &rule->race_offs[1]);
+}
+
+static bool suppress_init(const char *path) {
+    file_t f;
+    uint64 size;
+    char *buf, *line, *next;
+    if (path == NULL)
+        return true;
+    f = dr_open_file(path, DR_FILE_READ);
+    if (f == INVALID_FILE || !dr_file_size(f, &size)) {
+        dr_fprintf(STDERR, "unable to read suppression file %s\n", path);
+        return false;
+    }
+    buf = dr_global_alloc((size_t)size + 1);
+    buf[dr_read_file(f, buf, (size_t)size)] = '\0';
+    dr_close_file(f);
+    for (line = buf; line != NULL && *line != '\0'; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        /* strip comments, trailing whitespace and empty lines */
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (n_suppress_rules >= MAX_SUPPRESS_RULES) {
+            dr_fprintf(STDERR, "too many suppression rules, ignoring the rest\n");
+            break;
+        }
+        if (parse_suppress_line(line, &suppress_rules[n_suppress_rules])) {
+            if (suppress_rules[n_suppress_rules].kind == SUPPRESS_FUNCTION) {
+                suppress_function_patterns[n_suppress_function_patterns++] =
+                    suppress_rules[n_suppress_rules].pattern;
+            }
+            n_suppress_rules++;
+        } else
+            dr_fprintf(STDERR, "invalid suppression rule: %s\n", line);
+    }
+    dr_global_free(buf, (size_t)size + 1);
+    return true;
+}
+
+static uint pc_pair_hash(app_pc lo, app_pc hi) {
+    return (uint)((((ptr_uint_t)lo * 31) ^ (ptr_uint_t)hi) >> 2) & (SUPPRESSED_RACES_SIZE - 1);
+}
+
+static void suppress_race_pair(app_pc a, app_pc b) {
+    app_pc lo = a < b ? a : b, hi = a < b ? b : a;
+    uint i = pc_pair_hash(lo, hi);
+    while (suppressed_races[i].lo != NULL) {
+        if (suppressed_races[i].lo == lo && suppressed_races[i].hi == hi)
+            return;
+        i = (i + 1) & (SUPPRESSED_RACES_SIZE - 1);
+    }
+    /* hi first: lookups treat a slot as used once lo is set */
+    suppressed_races[i].hi = hi;
+    suppressed_races[i].lo = lo;
+}
+
+/* Called by the race detector for every found race, O(1) in the number of rules. */
+bool race_is_suppressed(app_pc pc, app_pc other_pc) {
+    app_pc lo = pc < other_pc ? pc : other_pc, hi = pc < other_pc ? other_pc : pc;
+    uint i = pc_pair_hash(lo, hi);
+    if (n_suppress_rules == 0)
+        return false;
+    while (suppressed_races[i].lo != NULL) {
+        if (suppressed_races[i].lo == lo && suppressed_races[i].hi == hi)
+            return true;
+        i = (i + 1) & (SUPPRESSED_RACES_SIZE - 1);
+    }
+    return false;
+}
+
+/* functions of one module matched by the file rules, as module offsets */
+typedef struct _suppress_lines_t {
+    const module_data_t *mod;
+    const char **patterns;
+    int n_patterns;
+    size_t last_func_start;
+    size_t *ranges;
+    uint n_ranges;
+    uint capacity;
+} suppress_lines_t;
+
+static void suppress_lines_add(suppress_lines_t *lines, size_t start, size_t end) {
+    if (lines->n_ranges == lines->capacity) {
+        uint capacity = lines->capacity == 0 ? 64 : lines->capacity * 2;
+        size_t *ranges = dr_global_alloc(capacity * 2 * sizeof(size_t));
+        if (lines->ranges != NULL) {
+            memcpy(ranges, lines->ranges, lines->n_ranges * 2 * sizeof(size_t));
+            dr_global_free(lines->ranges, lines->capacity * 2 * sizeof(size_t));
+        }
+        lines->ranges = ranges;
+        lines->capacity = capacity;
+    }
+    lines->ranges[2 * lines->n_ranges] = start;
+    lines->ranges[2 * lines->n_ranges + 1] = end;
+    lines->n_ranges++;
+}
+
+/* drsym_enumerate_lines callback collecting the function around every matching line */
+static bool suppress_source_line(drsym_line_info_t *info, void *data) {
+    suppress_lines_t *lines = (suppress_lines_t *)data;
+    drsym_info_t sym_info;
+    char name[MAX_FUNC_LEN];
+    int i;
+    if (info->file == NULL)
+        return true;
+    for (i = 0; i < lines->n_patterns; i++) {
+        if (glob_match(lines->patterns[i], info->file))
+            break;
+    }
+    if (i == lines->n_patterns)
+        return true;
+    sym_info.struct_size = sizeof(sym_info);
+    sym_info.name = name;
+    sym_info.name_size = MAX_FUNC_LEN;
+    sym_info.file = NULL;
+    sym_info.file_size = 0;
+    if (drsym_lookup_address(lines->mod->full_path, (size_t)info->line_addr, &sym_info,
+                             DRSYM_DEFAULT_FLAGS) != DRSYM_SUCCESS ||
+        sym_info.end_offs <= sym_info.start_offs)
+        return true;
+    /* lines of one function are mostly enumerated in a row, the range set merges the
+     * remaining duplicates
+     */
+    if (sym_info.start_offs != lines->last_func_start) {
+        lines->last_func_start = sym_info.start_offs;
+        suppress_lines_add(lines, sym_info.start_offs, sym_info.end_offs);
+    }
+    return true;
+}
+
+static void suppress_cached_range(size_t start, size_t end, void *data) {
+    const module_data_t *mod = (const module_data_t *)data;
+    range_set_add(&suppressed_ranges, mod->start + start, mod->start + end);
+}
+
+/* Walking a line table is as expensive as loading the whole debug info, so it only
+ * happens for modules some file rule applies to, once for all of them, and the result
+ * is kept in the symbol cache for the next run.
+ */
+static void suppress_resolve_files(const module_data_t *mod, const char **patterns,
+                                   int n_patterns) {
+    suppress_lines_t lines = { mod, patterns, n_patterns, SYMCACHE_NOT_FOUND };
+    uint i;
+    if (n_patterns == 0 ||
+        symcache_load_ranges(mod, patterns, n_patterns, suppress_cached_range, (void *)mod))
+        return;
+    if (drsym_enumerate_lines(mod->full_path, suppress_source_line, &lines) != DRSYM_SUCCESS)
+        return; /* no line info, nothing to suppress */
+    for (i = 0; i < lines.n_ranges; i++)
+        suppress_cached_range(lines.ranges[2 * i], lines.ranges[2 * i + 1], (void *)mod);
+    symcache_store_ranges(mod, patterns, n_patterns, lines.ranges, lines.n_ranges);
+    if (lines.ranges != NULL)
+        dr_global_free(lines.ranges, lines.capacity * 2 * sizeof(size_t));
+}
+
+static void suppress_resolve_module(const module_data_t *mod) {
+    int i, k;
+    const char *name = dr_module_preferred_name(mod);
+    const char **file_patterns = dr_global_alloc(n_suppress_rules * sizeof(char *));
+    int n_file_patterns = 0;
+    bool module_suppressed = false;
+    for (i = 0; i < n_suppress_rules; i++) {
+        suppress_rule_t *rule = &suppress_rules[i];
+        switch (rule->kind) {
+        case SUPPRESS_MODULE:
+            if (name != NULL && glob_match(rule->pattern, name)) {
+                range_set_add(&suppressed_ranges, mod->start, mod->end);
+                module_suppressed = true;
+            }
+            break;
+        case SUPPRESS_FUNCTION: break; /* all resolved at once below */
+        case SUPPRESS_FILE:
+            if (rule->module_pattern[0] == '\0' ||
+                (name != NULL && glob_match(rule->module_pattern, name)))
+                file_patterns[n_file_patterns++] = rule->pattern;
+            break;
+        case SUPPRESS_RACE:
+            if (name == NULL)
+                break;
+            dr_mutex_lock(suppress_mutex);
+            for (k = 0; k < 2; k++) {
+                if (strcmp(rule->race_module[k], name) == 0)
+                    rule->race_pc[k] = mod->start + rule->race_offs[k];
+            }
+            if (rule->race_pc[0] != NULL && rule->race_pc[1] != NULL)
+                suppress_race_pair(rule->race_pc[0], rule->race_pc[1]);
+            dr_mutex_unlock(suppress_mutex);
+            break;
+        }
+    }
+    /* function and file ranges of an entirely suppressed module would be redundant */
+    if (!module_suppressed) {
+        range_set_add_functions(&suppressed_ranges, mod, suppress_function_patterns,
+                                n_suppress_function_patterns);
+        suppress_resolve_files(mod, file_patterns, n_file_patterns);
+    }
+    dr_global_free(file_patterns, n_suppress_rules * sizeof(char *));
+}
+
+/* functions wrapped in every module defining them, their offsets are resolved through
+ * the symbol cache
+ */
+typedef struct _wrapped_function_t {
+    const char *name;
+    void (*pre_func)(void *wrapcxt, OUT void **user_data);
+    void (*post_func)(void *wrapcxt, void *user_data);
+} wrapped_function_t;
+
+static const wrapped_function_t wrapped_functions[] = {
+    { "pthread_mutex_lock", wrap_pre_lock, NULL },
+    { "pthread_mutex_unlock", wrap_pre_unlock, NULL },
+    { "detector_malloc", wrap_pre_malloc, wrap_post_malloc },
+};
+#define N_WRAPPED_FUNCTIONS (sizeof(wrapped_functions) / sizeof(wrapped_functions[0]))
+
+static void
+module_unload_event(void *drcontext, const module_data_t *mod)
+{
+    if (scope_restricted())
+        range_set_remove_module(&scope_ranges, mod);
+    if (n_suppress_rules > 0)
+        range_set_remove_module(&suppressed_ranges, mod);
+}
+
 static void
 module_load_event(void *drcontext, const module_data_t *mod, bool loaded)
 {
-    size_t modoffs_lock;
-    drsym_error_t sym_res_lock = drsym_lookup_symbol(mod->full_path, "pthread_mutex_lock", &modoffs_lock, DRSYM_DEMANGLE);
-    if (sym_res_lock == DRSYM_SUCCESS) {
-        app_pc towrap_lock = mod->start + modoffs_lock;
-        bool ok = drwrap_wrap(towrap_lock, wrap_pre_lock, NULL);
+    if (scope_restricted())
+        scope_resolve_module(mod);
+    if (n_suppress_rules > 0)
+        suppress_resolve_module(mod);
+
+    size_t offsets[N_WRAPPED_FUNCTIONS];
+    const char *names[N_WRAPPED_FUNCTIONS];
+    u32 i;
+    for (i = 0; i < N_WRAPPED_FUNCTIONS; i++)
+        names[i] = wrapped_functions[i].name;
+    symcache_lookup(mod, names, N_WRAPPED_FUNCTIONS, offsets);
+    for (i = 0; i < N_WRAPPED_FUNCTIONS; i++) {
+        if (offsets[i] == SYMCACHE_NOT_FOUND)
+            continue;
+        bool ok = drwrap_wrap(mod->start + offsets[i], wrapped_functions[i].pre_func,
+                              wrapped_functions[i].post_func);
         DR_ASSERT(ok);
     }
+}
 
-    size_t modoffs_unlock;
-    drsym_error_t sym_res_unlock = drsym_lookup_symbol(mod->full_path, "pthread_mutex_unlock", &modoffs_unlock, DRSYM_DEMANGLE);
-    if (sym_res_unlock == DRSYM_SUCCESS) {
-        app_pc towrap_unlock = mod->start + modoffs_unlock;
-        bool ok = drwrap_wrap(towrap_unlock, wrap_pre_unlock, NULL);
-        DR_ASSERT(ok);
+
+/* With -huge_pages, trace buffers of at least a huge page are aligned to one and advised
+ * for transparent huge pages. They stay DR raw memory: explicit MAP_HUGETLB pages need a
+ * raw mmap of our own, which DR wouldn't know about and would treat as app memory.
+ * madvise only changes how the kernel backs the range and is a no-op without THP. All
+ * pages are faulted in up front so the inlined buffer writes don't take page faults.
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/* a thread flushing more often than this per window gets its buffer doubled, one flushing
+ * at most MIN_FLUSHES_PER_WINDOW times gets it halved
+ */
+#define FLUSH_RATE_WINDOW_MS 100
+#define MAX_FLUSHES_PER_WINDOW 8
+#define MIN_FLUSHES_PER_WINDOW 1
+
+static void alloc_trace_buf(per_thread_t *data, size_t num_entries) {
+    size_t size = num_entries * sizeof(mem_ref_t);
+    size_t page_size = dr_page_size();
+    size_t i;
+    data->buf_alloc_size = size;
+    if (op_huge_pages && size >= HUGE_PAGE_SIZE) {
+        size = ALIGN_FORWARD(size, HUGE_PAGE_SIZE);
+        /* dr_raw_mem_alloc is only page aligned, the slack allows aligning the start */
+        data->buf_alloc_size = size + HUGE_PAGE_SIZE - page_size;
     }
-    size_t modoffs_malloc;
-    drsym_error_t sym_res_malloc = drsym_lookup_symbol(mod->full_path, "detector_malloc", &modoffs_malloc, DRSYM_DEMANGLE);
-    if (sym_res_malloc == DRSYM_SUCCESS) {
-        app_pc towrap_malloc = mod->start + modoffs_malloc;
-        bool ok = drwrap_wrap(towrap_malloc, wrap_pre_malloc, wrap_post_malloc);
-        DR_ASSERT(ok);
+    data->buf_alloc =
+        dr_raw_mem_alloc(data->buf_alloc_size, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    DR_ASSERT(data->buf_alloc != NULL);
+    data->buf_base = (mem_ref_t *)data->buf_alloc;
+    if (data->buf_alloc_size != size) {
+        data->buf_base = (mem_ref_t *)ALIGN_FORWARD((ptr_uint_t)data->buf_alloc, HUGE_PAGE_SIZE);
+        madvise(data->buf_base, size, MADV_HUGEPAGE);
     }
+    for (i = 0; i < size; i += page_size)
+        ((volatile byte *)data->buf_base)[i] = 0;
+    data->buf_size = size;
+    BUF_PTR(data->seg_base) = data->buf_base;
+    BUF_END(data->seg_base) =
+        data->buf_base + size / sizeof(mem_ref_t) - MAX_REFS_BETWEEN_CHECKS;
 }
 
+static void free_trace_buf(per_thread_t *data) {
+    dr_raw_mem_free(data->buf_alloc, data->buf_alloc_size);
+    data->buf_alloc = NULL;
+    data->buf_base = NULL;
+}
+
+/* Ends the flush rate window once it is over. The buffer is halved, down to op_buf_entries,
+ * for every window since window_start_ms that saw at most MIN_FLUSHES_PER_WINDOW full flushes,
+ * so a thread that went idle gives back what it grew into. Left as is if not empty.
+ */
+static void shrink_trace_buf(per_thread_t *data, uint64 now) {
+    size_t num_entries = data->buf_size / sizeof(mem_ref_t);
+    size_t new_entries = num_entries;
+    uint64 idle_windows;
+    if (now - data->window_start_ms < FLUSH_RATE_WINDOW_MS)
+        return;
+    idle_windows = (now - data->window_start_ms) / FLUSH_RATE_WINDOW_MS;
+    /* the windows after the first one passed without any flush */
+    if (data->num_window_flushes > MIN_FLUSHES_PER_WINDOW)
+        idle_windows--;
+    data->window_start_ms = now;
+    data->num_window_flushes = 0;
+    for (; idle_windows > 0 && new_entries / 2 >= op_buf_entries; idle_windows--)
+        new_entries /= 2;
+    if (new_entries == num_entries || BUF_PTR(data->seg_base) != data->buf_base)
+        return;
+    free_trace_buf(data);
+    alloc_trace_buf(data, new_entries);
+}
+
+/* Grows the buffer of threads that fill it often, so memory intensive threads flush less
+ * while idle threads keep their small buffer. Must only be called on an empty buffer.
+ */
+static void adjust_trace_buf(per_thread_t *data) {
+    uint64 now = dr_get_milliseconds();
+    size_t num_entries;
+    shrink_trace_buf(data, now);
+    num_entries = data->buf_size / sizeof(mem_ref_t);
+    data->num_window_flushes++;
+    if (data->num_window_flushes <= MAX_FLUSHES_PER_WINDOW || num_entries * 2 > op_max_buf_entries)
+        return;
+    DR_ASSERT(BUF_PTR(data->seg_base) == data->buf_base);
+    free_trace_buf(data);
+    alloc_trace_buf(data, num_entries * 2);
+    data->window_start_ms = now;
+    data->num_window_flushes = 0;
+}
+
+/* A thread that went idle doesn't fill its buffer anymore, so the shrinking is also checked
+ * whenever its buffer was processed early: at sync accesses and by the lock wrappers, where
+ * waiting threads pass through.
+ */
+void shrink_idle_trace_buf(void *drcontext) {
+    per_thread_t *data = drmgr_get_tls_field(drcontext, tls_idx);
+    if (data != NULL)
+        shrink_trace_buf(data, dr_get_milliseconds());
+}
 
 /* clean_call dumps the memory reference info to the log file */
 static void clean_call(void) {
     void *drcontext = dr_get_current_drcontext();
     u64 thread_id = dr_get_thread_id(drcontext);
     memtrace(drcontext, thread_id);
+    adjust_trace_buf(drmgr_get_tls_field(drcontext, tls_idx));
+}
+
+/* sync_flush_call processes the buffer right at a sync access. Plain accesses are only
+ * processed when the buffer fills up, so their order across threads is lost anyway, but
+ * releases and acquires have to reach the detector in execution order or the
+ * happens-before edges point the wrong way. Not counted as a full buffer by
+ * adjust_trace_buf, but may shrink it.
+ */
+static void sync_flush_call(void) {
+    void *drcontext = dr_get_current_drcontext();
+    memtrace(drcontext, dr_get_thread_id(drcontext));
+    shrink_idle_trace_buf(drcontext);
+}
+
+static void insert_sync_flush(void *drcontext, instrlist_t *ilist, instr_t *where) {
+    instrlist_set_auto_predicate(ilist, DR_PRED_NONE);
+    dr_insert_clean_call(drcontext, ilist, where, (void *)sync_flush_call, false, 0);
+    instrlist_set_auto_predicate(ilist, instr_get_predicate(where));
 }
 
 static void insert_load_buf_ptr(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t reg_ptr) {
@@ -79,9 +826,16 @@ static void insert_load_buf_ptr(void *drcontext, instrlist_t *ilist, instr_t *wh
 
 static void insert_update_buf_ptr(void *drcontext, instrlist_t *ilist, instr_t *where,
                       reg_id_t reg_ptr, int adjust) {
+#ifdef X86
+    /* lea instead of add, add would clobber the app's aflags */
+    MINSERT(ilist, where,
+            INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_ptr),
+                             OPND_CREATE_MEM_lea(reg_ptr, DR_REG_NULL, 0, adjust)));
+#else
     MINSERT(
         ilist, where,
         XINST_CREATE_add(drcontext, opnd_create_reg(reg_ptr), OPND_CREATE_INT16(adjust)));
+#endif
     dr_insert_write_raw_tls(drcontext, ilist, where, tls_seg,
                             tls_offs + MEMTRACE_TLS_OFFS_BUF_PTR, reg_ptr);
 }
@@ -133,6 +887,113 @@ static void insert_save_addr(void *drcontext, instrlist_t *ilist, instr_t *where
                                opnd_create_reg(reg_addr)));
 }
 
+/* The buffer check runs after every memory reference instruction, so it avoids touching
+ * the arithmetic flags wherever it can: spilling live aflags is the most expensive part
+ * of inline instrumentation on x86. Each variant jumps to skip_call while the buffer
+ * pointer is below its flush threshold (buf_end).
+ */
+#if defined(AARCH64)
+/* sub doesn't set NZCV on AArch64 and tbz tests the sign bit of buf_end - buf_ptr */
+static void insert_buf_full_branch(void *drcontext, instrlist_t *ilist, instr_t *where,
+                      reg_id_t reg_ptr, reg_id_t reg_end, instr_t *skip_call) {
+    MINSERT(ilist, where,
+            XINST_CREATE_sub(drcontext, opnd_create_reg(reg_end), opnd_create_reg(reg_ptr)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_tbz(drcontext, opnd_create_instr(skip_call), opnd_create_reg(reg_end),
+                             opnd_create_immed_int(63, OPSZ_6b)));
+}
+#elif defined(X86_64)
+/* Flag free: xcx = buf_end - buf_ptr computed with not/lea, bswap moves the sign byte
+ * to cl and jrcxz skips the flush while it is zero. jrcxz only reaches 127 bytes, so it
+ * goes through a jmp trampoline around the clean call.
+ */
+static void insert_buf_full_branch_no_aflags(void *drcontext, instrlist_t *ilist, instr_t *where,
+                      reg_id_t reg_ptr, reg_id_t reg_xcx, instr_t *skip_call) {
+    instr_t *not_full = INSTR_CREATE_label(drcontext);
+    instr_t *flush = INSTR_CREATE_label(drcontext);
+    MINSERT(ilist, where, INSTR_CREATE_not(drcontext, opnd_create_reg(reg_ptr)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_xcx),
+                             opnd_create_base_disp(reg_xcx, reg_ptr, 1, 1, OPSZ_lea)));
+    MINSERT(ilist, where, INSTR_CREATE_bswap(drcontext, opnd_create_reg(reg_xcx)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_movzx(drcontext, opnd_create_reg(DR_REG_ECX),
+                               opnd_create_reg(DR_REG_CL)));
+    MINSERT(ilist, where, INSTR_CREATE_jecxz(drcontext, opnd_create_instr(not_full)));
+    MINSERT(ilist, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(flush)));
+    MINSERT(ilist, where, not_full);
+    MINSERT(ilist, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(skip_call)));
+    MINSERT(ilist, where, flush);
+}
+#endif
+
+/* unsigned buf_ptr < buf_end: skip the flush, needs reserved aflags */
+static void insert_buf_full_branch_cmp(void *drcontext, instrlist_t *ilist, instr_t *where,
+                      reg_id_t reg_ptr, reg_id_t reg_end, instr_t *skip_call) {
+    MINSERT(ilist, where,
+            XINST_CREATE_cmp(drcontext, opnd_create_reg(reg_ptr), opnd_create_reg(reg_end)));
+    MINSERT(ilist, where,
+            XINST_CREATE_jump_cond(drcontext, IF_X86_ELSE(DR_PRED_B, DR_PRED_CC),
+                                   opnd_create_instr(skip_call)));
+}
+
+/* insert inline code calling clean_call only once the buffer reached its flush threshold */
+static void insert_check_buf_full(void *drcontext, instrlist_t *ilist, instr_t *where) {
+    reg_id_t reg_ptr, reg_end;
+    instr_t *skip_call = INSTR_CREATE_label(drcontext);
+    drvector_t allowed;
+    bool use_aflags = true;
+#if defined(AARCH64)
+    use_aflags = false;
+#elif defined(X86_64)
+    bool aflags_dead;
+    /* with dead aflags the cmp/jcc sequence is shorter and needs no spill either */
+    use_aflags = drreg_are_aflags_dead(drcontext, where, &aflags_dead) == DRREG_SUCCESS &&
+        aflags_dead;
+#endif
+    instrlist_set_auto_predicate(ilist, DR_PRED_NONE);
+    if (use_aflags && drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false); /* cannot recover */
+        return;
+    }
+#if defined(X86_64)
+    /* the flag free sequence needs xcx for jrcxz */
+    drreg_init_and_fill_vector(&allowed, use_aflags);
+    if (!use_aflags)
+        drreg_set_vector_entry(&allowed, DR_REG_XCX, true);
+#else
+    drreg_init_and_fill_vector(&allowed, true);
+#endif
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_end) !=
+            DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) !=
+            DRREG_SUCCESS) {
+        drvector_delete(&allowed);
+        DR_ASSERT(false); /* cannot recover */
+        return;
+    }
+    drvector_delete(&allowed);
+    insert_load_buf_ptr(drcontext, ilist, where, reg_ptr);
+    dr_insert_read_raw_tls(drcontext, ilist, where, tls_seg,
+                           tls_offs + MEMTRACE_TLS_OFFS_BUF_END, reg_end);
+    if (use_aflags)
+        insert_buf_full_branch_cmp(drcontext, ilist, where, reg_ptr, reg_end, skip_call);
+#if defined(AARCH64)
+    else
+        insert_buf_full_branch(drcontext, ilist, where, reg_ptr, reg_end, skip_call);
+#elif defined(X86_64)
+    else
+        insert_buf_full_branch_no_aflags(drcontext, ilist, where, reg_ptr, reg_end, skip_call);
+#endif
+    dr_insert_clean_call(drcontext, ilist, where, (void *)clean_call, false, 0);
+    MINSERT(ilist, where, skip_call);
+    if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, ilist, where, reg_end) != DRREG_SUCCESS ||
+        (use_aflags && drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS))
+        DR_ASSERT(false);
+    instrlist_set_auto_predicate(ilist, instr_get_predicate(where));
+}
+
 /* insert inline code to add an instruction entry into the buffer */
 static void instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *where, instr_t *instr) {
     /* We need two scratch registers */
@@ -162,7 +1023,7 @@ static void instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *where
 
 /* insert inline code to add a memory reference info entry into the buffer */
 static void instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref,
-               bool write) {
+               ushort type) {
     /* We need two scratch registers */
     reg_id_t reg_ptr, reg_tmp;
     if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) !=
@@ -174,8 +1035,7 @@ static void instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
     }
     /* save_addr should be called first as reg_ptr or reg_tmp maybe used in ref */
     insert_save_addr(drcontext, ilist, where, ref, reg_ptr, reg_tmp);
-    insert_save_type(drcontext, ilist, where, reg_ptr, reg_tmp,
-                     write ? REF_TYPE_WRITE : REF_TYPE_READ);
+    insert_save_type(drcontext, ilist, where, reg_ptr, reg_tmp, type);
     insert_save_size(drcontext, ilist, where, reg_ptr, reg_tmp,
                      (ushort)drutil_opnd_mem_size_in_bytes(ref, where));
     insert_update_buf_ptr(drcontext, ilist, where, reg_ptr, sizeof(mem_ref_t));
@@ -185,6 +1045,131 @@ static void instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
         DR_ASSERT(false);
 }
 
+/* Switches the memory reference instrumentation on or off. Already built fragments
+ * still carry the old (non-)instrumentation, so the whole code cache is flushed and
+ * every block is rebuilt lazily on its next execution.
+ */
+/* must be called with toggle_mutex held */
+static void switch_instrumentation_locked(bool enable) {
+    if (instrumentation_enabled != enable) {
+        instrumentation_enabled = enable;
+        /* we may be called from a nudge or a client thread, so the flush is delayed
+         * until DR reaches a safe point instead of using dr_flush_region directly
+         */
+        if (!dr_delay_flush_region((app_pc)NULL, ~(size_t)0, 0, NULL))
+            DR_ASSERT(false);
+        dr_fprintf(STDERR, "instrumentation %s\n", enable ? "enabled" : "disabled");
+    }
+}
+
+static void set_instrumentation_enabled(bool enable) {
+    dr_mutex_lock(toggle_mutex);
+    switch_instrumentation_locked(enable);
+    dr_mutex_unlock(toggle_mutex);
+}
+
+/* reads and flips the state under the same lock, so concurrent toggles never collapse */
+static void toggle_instrumentation(void) {
+    dr_mutex_lock(toggle_mutex);
+    switch_instrumentation_locked(!instrumentation_enabled);
+    dr_mutex_unlock(toggle_mutex);
+}
+
+static void event_nudge(void *drcontext, uint64 argument) {
+    switch (argument) {
+    case NUDGE_ENABLE_INSTRUMENTATION: set_instrumentation_enabled(true); break;
+    case NUDGE_DISABLE_INSTRUMENTATION: set_instrumentation_enabled(false); break;
+    default: toggle_instrumentation(); break;
+    }
+}
+
+/* client thread driving -enable_after_ms/-window_ms: turns detection on after the
+ * given delay and, if a window is set, off again once the window has passed
+ */
+static void detection_window_thread(void *arg) {
+    if (op_enable_after_ms > 0)
+        dr_sleep(op_enable_after_ms);
+    set_instrumentation_enabled(true);
+    if (op_window_ms > 0) {
+        dr_sleep(op_window_ms);
+        set_instrumentation_enabled(false);
+    }
+}
+
+/* Decides once per block whether it gets instrumented, so a toggle that happens while
+ * a block is being built can't leave it half instrumented. Blocks outside the
+ * -only_* scope or starting in suppressed code are never instrumented.
+ * The decision depends on global state that a toggle changes before the delayed flush
+ * has removed the old fragments, so re-creating a fragment to translate a fault or
+ * signal pc could decide differently than the original build. DR therefore stores the
+ * translation info of every fragment and never re-runs these events when translating.
+ */
+static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb,
+                      bool for_trace, bool translating, OUT void **user_data) {
+    app_pc pc = dr_fragment_app_pc(tag);
+    *user_data =
+        (void *)(ptr_uint_t)(instrumentation_enabled && pc_in_scope(pc) && !pc_suppressed(pc));
+    return DR_EMIT_STORE_TRANSLATIONS;
+}
+
+/* Returns whether instr is an atomic, exclusive or acquire/release access. Such accesses
+ * can't be plain data races, their memory refs are recorded as sync events instead.
+ */
+static bool instr_is_sync_access(instr_t *instr) {
+#if defined(X86)
+    /* xchg with a memory operand is implicitly locked */
+    return instr_get_prefix_flag(instr, PREFIX_LOCK) ||
+        (instr_get_opcode(instr) == OP_xchg && instr_writes_memory(instr));
+#elif defined(AARCH64)
+    if (instr_is_exclusive_load(instr) || instr_is_exclusive_store(instr))
+        return true;
+    switch (instr_get_opcode(instr)) {
+    /* load-acquire/store-release, including the RCpc loads */
+    case OP_ldar: case OP_ldarb: case OP_ldarh:
+    case OP_ldapr: case OP_ldaprb: case OP_ldaprh:
+    case OP_stlr: case OP_stlrb: case OP_stlrh:
+    /* LSE atomics in word/doubleword, byte and halfword forms */
+    case OP_cas: case OP_casa: case OP_casal: case OP_casl:
+    case OP_casb: case OP_casab: case OP_casalb: case OP_caslb:
+    case OP_cash: case OP_casah: case OP_casalh: case OP_caslh:
+    case OP_swp: case OP_swpa: case OP_swpal: case OP_swpl:
+    case OP_swpb: case OP_swpab: case OP_swpalb: case OP_swplb:
+    case OP_swph: case OP_swpah: case OP_swpalh: case OP_swplh:
+    case OP_ldadd: case OP_ldadda: case OP_ldaddal: case OP_ldaddl:
+    case OP_ldaddb: case OP_ldaddab: case OP_ldaddalb: case OP_ldaddlb:
+    case OP_ldaddh: case OP_ldaddah: case OP_ldaddalh: case OP_ldaddlh:
+    case OP_ldclr: case OP_ldclra: case OP_ldclral: case OP_ldclrl:
+    case OP_ldclrb: case OP_ldclrab: case OP_ldclralb: case OP_ldclrlb:
+    case OP_ldclrh: case OP_ldclrah: case OP_ldclralh: case OP_ldclrlh:
+    case OP_ldeor: case OP_ldeora: case OP_ldeoral: case OP_ldeorl:
+    case OP_ldeorb: case OP_ldeorab: case OP_ldeoralb: case OP_ldeorlb:
+    case OP_ldeorh: case OP_ldeorah: case OP_ldeoralh: case OP_ldeorlh:
+    case OP_ldset: case OP_ldseta: case OP_ldsetal: case OP_ldsetl:
+    case OP_ldsetb: case OP_ldsetab: case OP_ldsetalb: case OP_ldsetlb:
+    case OP_ldseth: case OP_ldsetah: case OP_ldsetalh: case OP_ldsetlh:
+    case OP_ldsmax: case OP_ldsmaxa: case OP_ldsmaxal: case OP_ldsmaxl:
+    case OP_ldsmaxb: case OP_ldsmaxab: case OP_ldsmaxalb: case OP_ldsmaxlb:
+    case OP_ldsmaxh: case OP_ldsmaxah: case OP_ldsmaxalh: case OP_ldsmaxlh:
+    case OP_ldsmin: case OP_ldsmina: case OP_ldsminal: case OP_ldsminl:
+    case OP_ldsminb: case OP_ldsminab: case OP_ldsminalb: case OP_ldsminlb:
+    case OP_ldsminh: case OP_ldsminah: case OP_ldsminalh: case OP_ldsminlh:
+    case OP_ldumax: case OP_ldumaxa: case OP_ldumaxal: case OP_ldumaxl:
+    case OP_ldumaxb: case OP_ldumaxab: case OP_ldumaxalb: case OP_ldumaxlb:
+    case OP_ldumaxh: case OP_ldumaxah: case OP_ldumaxalh: case OP_ldumaxlh:
+    case OP_ldumin: case OP_ldumina: case OP_lduminal: case OP_lduminl:
+    case OP_lduminb: case OP_lduminab: case OP_lduminalb: case OP_lduminlb:
+    case OP_lduminh: case OP_lduminah: case OP_lduminalh: case OP_lduminlh:
+    /* compare and swap pair */
+    case OP_casp: case OP_caspa: case OP_caspal: case OP_caspl:
+        return true;
+    default:
+        return false;
+    }
+#else
+    return instr_is_exclusive_load(instr) || instr_is_exclusive_store(instr);
+#endif
+}
+
 /* For each memory reference app instr, we insert inline code to fill the buffer
  * with an instruction entry and memory reference entries.
  */
@@ -192,6 +1177,18 @@ static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrli
                       bool for_trace, bool translating, void *user_data) {
     int i;
 
+    if (!(bool)(ptr_uint_t)user_data)
+        return DR_EMIT_DEFAULT;
+
+#ifdef AARCHXX
+    /* no flush may be inserted before an exclusive store (see below), its release is
+     * processed right after it instead
+     */
+    instr_t *prev = instr_get_prev_app(where);
+    if (prev != NULL && instr_is_exclusive_store(prev))
+        insert_sync_flush(drcontext, bb, where);
+#endif
+
     /* Insert code to add an entry for each app instruction. */
     /* Use the drmgr_orig_app_instr_* interface to properly handle our own use
      * of drutil_expand_rep_string() and drx_expand_scatter_gather() (as well
@@ -211,18 +1208,24 @@ static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrli
         return DR_EMIT_DEFAULT;
     DR_ASSERT(instr_is_app(instr_operands));
 
+    /* reads of sync accesses act as acquire, writes as release (a RMW does both) */
+    bool sync = instr_is_sync_access(instr_operands);
     for (i = 0; i < instr_num_srcs(instr_operands); i++) {
         if (opnd_is_memory_reference(instr_get_src(instr_operands, i)))
-            instrument_mem(drcontext, bb, where, instr_get_src(instr_operands, i), false);
+            instrument_mem(drcontext, bb, where, instr_get_src(instr_operands, i),
+                           sync ? REF_TYPE_SYNC_ACQUIRE : REF_TYPE_READ);
     }
 
     for (i = 0; i < instr_num_dsts(instr_operands); i++) {
         if (opnd_is_memory_reference(instr_get_dst(instr_operands, i)))
-            instrument_mem(drcontext, bb, where, instr_get_dst(instr_operands, i), true);
+            instrument_mem(drcontext, bb, where, instr_get_dst(instr_operands, i),
+                           sync ? REF_TYPE_SYNC_RELEASE : REF_TYPE_WRITE);
     }
 
-    /* insert code to call clean_call for processing the buffer */
-    if (/* XXX i#1698: there are constraints for code between ldrex/strex pairs,
+    /* sync accesses are processed right away, everything else once the buffer is full */
+    if (sync && IF_AARCHXX_ELSE(!instr_is_exclusive_store(instr_operands), true))
+        insert_sync_flush(drcontext, bb, where);
+    else if (/* XXX i#1698: there are constraints for code between ldrex/strex pairs,
          * so we minimize the instrumentation in between by skipping the clean call.
          * As we're only inserting instrumentation on a memory reference, and the
          * app should be avoiding memory accesses in between the ldrex...strex,
@@ -233,7 +1236,7 @@ static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrli
          * forthcoming buffer filling API (i#513) will provide that.
          */
         IF_AARCHXX_ELSE(!instr_is_exclusive_store(instr_operands), true))
-        dr_insert_clean_call(drcontext, bb, where, (void *)clean_call, false, 0);
+        insert_check_buf_full(drcontext, bb, where);
 
     return DR_EMIT_DEFAULT;
 }
@@ -303,29 +1306,32 @@ static void event_thread_init(void *drcontext) {
      * slot and find where the pointer points to in the buffer.
      */
     data->seg_base = dr_get_dr_segment_base(tls_seg);
-    data->buf_base = dr_raw_mem_alloc(MEM_BUF_SIZE, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
-    DR_ASSERT(data->seg_base != NULL && data->buf_base != NULL);
-    /* put buf_base to TLS as starting buf_ptr */
-    BUF_PTR(data->seg_base) = data->buf_base;
+    DR_ASSERT(data->seg_base != NULL);
+    /* puts buf_base to TLS as starting buf_ptr */
+    alloc_trace_buf(data, op_buf_entries);
+    data->window_start_ms = dr_get_milliseconds();
+    data->num_window_flushes = 0;
     data->num_refs = 0;
     data->logf = stderr;
 }
 
 static void event_thread_exit(void *drcontext) {
     u64 thread_id = dr_get_thread_id(drcontext);
-    mem_analyse_thread_exit();
     per_thread_t *data;
     memtrace(drcontext, thread_id); /* dump any remaining buffer entries */
+    mem_analyse_thread_exit(drcontext);
     data = drmgr_get_tls_field(drcontext, tls_idx);
     dr_mutex_lock(mutex);
     num_refs += data->num_refs;
     dr_mutex_unlock(mutex);
-    dr_raw_mem_free(data->buf_base, MEM_BUF_SIZE);
+    free_trace_buf(data);
     dr_thread_free(drcontext, data, sizeof(per_thread_t));
 }
 
 static void event_exit(void) {
     mem_analyse_exit();
+    report_exit();
+    symcache_exit();
 
     if (!dr_raw_tls_cfree(tls_offs, MEMTRACE_TLS_COUNT))
         DR_ASSERT(false);
@@ -335,10 +1341,18 @@ static void event_exit(void) {
         !drmgr_unregister_thread_exit_event(event_thread_exit) ||
         // !drmgr_unregister_pre_syscall_event(event_pre_syscall) ||
         !drmgr_unregister_bb_app2app_event(event_bb_app2app) ||
-        !drmgr_unregister_bb_insertion_event(event_app_instruction) ||
+        !drmgr_unregister_bb_instrumentation_event(event_bb_analysis) ||
+        !dr_unregister_nudge_event(event_nudge, client_id) ||
+        !drmgr_unregister_module_load_event(module_load_event) ||
+        !drmgr_unregister_module_unload_event(module_unload_event) ||
         drreg_exit() != DRREG_SUCCESS)
         DR_ASSERT(false);
 
+    dr_mutex_destroy(watch_site_mutex);
+    dr_rwlock_destroy(suppressed_ranges.lock);
+    dr_mutex_destroy(suppress_mutex);
+    dr_rwlock_destroy(scope_ranges.lock);
+    dr_mutex_destroy(toggle_mutex);
     dr_mutex_destroy(mutex);
     drutil_exit();
     drmgr_exit();
@@ -347,6 +1361,65 @@ static void event_exit(void) {
     drsym_exit();
 }
 
+/* copies a ',' separated option value into buf and splits it into patterns */
+static int split_list_option(const char *value, char *buf, const char **patterns) {
+    int n = 0;
+    char *tok;
+    strncpy(buf, value, MAX_OPTION_LEN - 1);
+    buf[MAX_OPTION_LEN - 1] = '\0';
+    for (tok = strtok(buf, ","); tok != NULL && n < MAX_SCOPE_PATTERNS; tok = strtok(NULL, ","))
+        patterns[n++] = tok;
+    return n;
+}
+
+static void parse_options(int argc, const char *argv[]) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-start_disabled") == 0) {
+            op_start_disabled = true;
+        } else if (strcmp(argv[i], "-enable_after_ms") == 0 && i + 1 < argc) {
+            op_enable_after_ms = (uint)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-window_ms") == 0 && i + 1 < argc) {
+            op_window_ms = (uint)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-report_file") == 0 && i + 1 < argc) {
+            op_report_file = argv[++i];
+        } else if (strcmp(argv[i], "-symcache_dir") == 0 && i + 1 < argc) {
+            op_symcache_dir = argv[++i];
+        } else if (strcmp(argv[i], "-suppress") == 0 && i + 1 < argc) {
+            op_suppress_file = argv[++i];
+        } else if (strcmp(argv[i], "-buf_entries") == 0 && i + 1 < argc) {
+            op_buf_entries = (uint)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-max_buf_entries") == 0 && i + 1 < argc) {
+            op_max_buf_entries = (uint)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-huge_pages") == 0) {
+            op_huge_pages = true;
+        } else if (strcmp(argv[i], "-only_modules") == 0 && i + 1 < argc) {
+            n_scope_module_patterns =
+                split_list_option(argv[++i], op_only_modules, scope_module_patterns);
+        } else if (strcmp(argv[i], "-only_functions") == 0 && i + 1 < argc) {
+            n_scope_function_patterns =
+                split_list_option(argv[++i], op_only_functions, scope_function_patterns);
+        } else if (strcmp(argv[i], "-watch_min_size") == 0 && i + 1 < argc) {
+            op_watch_min_size = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-watch_max_size") == 0 && i + 1 < argc) {
+            op_watch_max_size = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-watch_callers") == 0 && i + 1 < argc) {
+            n_watch_caller_patterns =
+                split_list_option(argv[++i], op_watch_callers, watch_caller_patterns);
+        } else {
+            dr_fprintf(STDERR, "unknown client option: %s\n", argv[i]);
+            DR_ASSERT(false);
+        }
+    }
+    if (op_buf_entries < MAX_REFS_BETWEEN_CHECKS * 2)
+        op_buf_entries = MAX_REFS_BETWEEN_CHECKS * 2;
+    if (op_max_buf_entries < op_buf_entries)
+        op_max_buf_entries = op_buf_entries;
+    /* a timed window only makes sense if detection is off until the window opens */
+    if (op_enable_after_ms > 0 || op_window_ms > 0)
+        op_start_disabled = true;
+}
+
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
     /* We need 2 reg slots beyond drreg's eflags slots => 3 slots */
     drreg_options_t drreg_ops = { sizeof(drreg_ops), 3, false };
@@ -354,7 +1427,13 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
         sizeof(callstack_ops),
     };
     
+    parse_options(argc, argv);
+    instrumentation_enabled = !op_start_disabled;
+
     if (!mem_analyse_init()) DR_ASSERT(false);
+    if (!report_init(op_report_file)) DR_ASSERT(false);
+    if (!symcache_init(op_symcache_dir)) DR_ASSERT(false);
+    if (!suppress_init(op_suppress_file)) DR_ASSERT(false);
 
     if (!drmgr_init() || drreg_init(&drreg_ops) != DRREG_SUCCESS || !drutil_init() ||
         !drx_init())
@@ -366,15 +1445,22 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
         !drmgr_register_thread_exit_event(event_thread_exit) ||
         // !drmgr_register_pre_syscall_event(event_pre_syscall) ||
         !drmgr_register_bb_app2app_event(event_bb_app2app, NULL) ||
-        !drmgr_register_bb_instrumentation_event(NULL /*analysis_func*/, event_app_instruction, NULL) ||
+        !drmgr_register_bb_instrumentation_event(event_bb_analysis, event_app_instruction, NULL) ||
         !drwrap_init() || 
         drcallstack_init(&callstack_ops) != DRCALLSTACK_SUCCESS ||
         drsym_init(0) != DRSYM_SUCCESS ||
-        !drmgr_register_module_load_event(module_load_event))
+        !drmgr_register_module_load_event(module_load_event) ||
+        !drmgr_register_module_unload_event(module_unload_event))
         DR_ASSERT(false);
 
     client_id = id;
     mutex = dr_mutex_create();
+    toggle_mutex = dr_mutex_create();
+    scope_ranges.lock = dr_rwlock_create();
+    suppressed_ranges.lock = dr_rwlock_create();
+    suppress_mutex = dr_mutex_create();
+    watch_site_mutex = dr_mutex_create();
+    dr_register_nudge_event(event_nudge, id);
 
     tls_idx = drmgr_register_tls_field();
     DR_ASSERT(tls_idx != -1);
@@ -384,4 +1470,9 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
      */
     if (!dr_raw_tls_calloc(&tls_seg, &tls_offs, MEMTRACE_TLS_COUNT, 0))
         DR_ASSERT(false);
+
+    if (op_enable_after_ms > 0 || op_window_ms > 0) {
+        if (!dr_create_client_thread(detection_window_thread, NULL))
+            DR_ASSERT(false);
+    }
 }
\ No newline at end of file
@@ -3,7 +3,13 @@
 #define MAX_THREADS 100
 #define MAX_ALLOCS 10000
 #define MAX_LOCKS 10000
-const u64 linear_set_size_increment = 1000000;
+#define SYNC_VARS_SIZE 16384 // power of 2, open addressing hash table
+
+// program_threads[0] is not a real thread but the summary of all retired threads. It takes
+// over the allocations of every thread that exits and folds in its clock, so their slots can be
+// reused. DynamoRIO thread ids are never -1.
+#define RETIRED_THREADS_INDEX 0
+#define RETIRED_THREADS_ID ((u64)-1)
 
 
 
@@ -23,14 +29,28 @@ typedef struct LockAccess {
 // bytes of the virtual address that define the memory locations relative to the process pages)
 // reference: https://developer.arm.com/documentation/den0024/a/The-Memory-Management-Unit/Translating-a-Virtual-Address-to-a-Physical-Address
 // abstract: only the last 28 bits of an virtual address encode the actual loation(or index) of the address, the rest is context
+// accesses are split into 8 byte granules, each entry covers the bytes of one granule given
+// by byte_mask. two accesses overlap if they hit the same granule with intersecting masks,
+// which catches overlapping accesses of different widths (memcpy, vector loads).
+#define GRANULE_SHIFT 3
+#define GRANULE_SIZE (1 << GRANULE_SHIFT)
+
 typedef struct MemoryAccess {
+   // first byte of the access within its granule
    usize address_accessed;
+   usize granule;
+   u8 byte_mask;
+   // pc of the accessing instruction
+   usize pc;
    u16 opcode;
    u64 size;
    u64 callee_thread_id;
    u64 memory_access_count;
    u32 has_lock;
    LockAccess lock_access;
+   // last release (see SyncVar) the accessing thread acquired before this access
+   u64 acquired_count;
+   u64 acquired_from_thread_id;
 } MemoryAccess;
 
 
@@ -43,6 +63,16 @@ typedef struct LockState {
 } LockState;
 
 
+// an address accessed by atomic/exclusive/acquire-release instructions. a release (sync write)
+// stores the current access count, a later acquire (sync read) by another thread orders all
+// accesses of the releasing thread up to that count before the acquiring threads accesses.
+// sync variables are hashed by address (0 marks a free slot), a lookup is O(1) for any address.
+typedef struct SyncVar {
+   usize addr;
+   u64 release_count;
+   u64 releasing_thread_id;
+} SyncVar;
+
 typedef struct MemoryAllocation {
    usize addr;
    u64 size;
@@ -52,19 +82,25 @@ typedef struct MemoryAllocation {
 
 typedef struct ThreadState {
     u64 thread_id;
-    MemoryAccess *mem_read_set;
-    u64 mem_read_set_capacity;
-    u64 mem_read_set_len;
-
-    MemoryAccess *mem_write_set;
-    u64 mem_write_set_capacity;
-    u64 mem_write_set_len;
-
     isize last_locked_mutex_addr;
+    // happens-before edge of the last acquire, copied into every recorded access
+    u64 acquired_count;
+    u64 acquired_from_thread_id;
+    // count of the threads last release, see shadow_insert
+    u64 last_release_count;
+    // count of the threads last access or release. the retired threads summary holds the max
+    // over all exited threads
+    u64 clock;
+    // the summaries clock when the thread started. shadowed accesses of the threads id up to this
+    // count were made by an exited thread whose id the OS reused
+    u64 start_count;
+    // 0 if the slot is free and can be reused by a new thread
+    u32 active;
 } ThreadState;
 
 usize checked_but_ok_races_counter = 0;
 usize detected_races_counter = 0;
+usize suppressed_races_counter = 0;
 
 
 // max program_allocations is seperate from thread state since it needs to be itreated thorugh on every error check
@@ -75,24 +111,69 @@ u64 n_program_allocs = 0;
 ThreadState program_threads[MAX_THREADS] = {};
 pthread_mutex_t mutex_program_threads = PTHREAD_MUTEX_INITIALIZER;
 u64 n_program_threads = 0;
+u64 n_retired_threads = 0;
 
 LockState program_locks[MAX_LOCKS] = {};
 pthread_mutex_t mutex_program_locks = PTHREAD_MUTEX_INITIALIZER;
 u64 n_program_locks;
 
+SyncVar program_sync_vars[SYNC_VARS_SIZE] = {};
+pthread_mutex_t mutex_program_sync_vars = PTHREAD_MUTEX_INITIALIZER;
+u64 n_program_sync_vars = 0;
+// releases that found the table full, their happens-before edges are lost
+u64 dropped_sync_releases = 0;
+
+// the detectors clock. it's advanced when a trace buffer is processed, so it orders the accesses of
+// one thread and sync events (whose buffers are flushed immediately), but plain accesses of different
+// threads only by the order their buffers were processed in.
 u64 memory_access_counter = 0;
 
-// util fns..
-void *increase_set_capacity(void *set, u64 *set_capacity) {
-    *set_capacity += linear_set_size_increment;
-    printf("new set_capacity: %ld \n", *set_capacity);
-    return realloc(set, *set_capacity);
+// ticks the clock. memtrace and handle_sync_access run concurrently under different locks, so the
+// increment must be atomic or happens_before compares lost or duplicated counts.
+u64 next_access_count() {
+    u64 count = (u64)dr_atomic_add64_return_sum((volatile int64 *)&memory_access_counter, 1);
+    if (count >= LLONG_MAX) DR_ASSERT(false);
+    return count;
 }
 
+// shadow of the accesses per granule. every slot keeps the bytes (byte_mask) one thread last read
+// or wrote and what a later write needs to check them: thread, access count and lock state. a write
+// is checked against all slots of other threads and then takes over the bytes it wrote, a read only
+// replaces earlier reads of the same thread. that way a read isn't hidden by a read of another thread
+// and an access to other bytes of the granule doesn't hide a conflict on the bytes it didn't touch.
+// open addressing hash table keyed by granule (granule 0 can't be part of an allocation and marks a
+// free slot), doubled at 3/4 load, only used under mutex_program_threads.
+#define GRANULE_SHADOW_INITIAL_SIZE 4096 // power of 2
+#define SHADOW_SLOTS 4
+
+typedef struct ShadowAccess {
+   u64 thread_id;
+   u64 memory_access_count;
+   // pc and opcode are only kept for the report
+   usize pc;
+   u16 opcode;
+   // 0 marks a free slot
+   u8 byte_mask;
+   u8 is_write;
+   u8 lock_state;
+} ShadowAccess;
+
+typedef struct GranuleShadow {
+   usize granule;
+   ShadowAccess slots[SHADOW_SLOTS];
+} GranuleShadow;
+
+GranuleShadow *granule_shadow = NULL;
+u64 granule_shadow_size = 0;
+u64 n_granule_shadows = 0;
+// slots dropped from full granules, races with them are missed
+u64 shadow_evictions = 0;
+
+// util fns..
 i64 find_thread_by_tid(u64 tid) {
     u64 i;
-    for (i = 0; i <= n_program_threads; i++) {
-        if (program_threads[i].thread_id == tid) {
+    for (i = 0; i < n_program_threads; i++) {
+        if (program_threads[i].active && program_threads[i].thread_id == tid) {
             return i;
         }
     }
@@ -102,6 +183,15 @@ i64 find_thread_by_tid(u64 tid) {
 u32 is_in_range(u64 num, u64 min, u64 max) {      
     return (min <= num && num <= max); 
 }
+
+// true if the slot was stored by the thread and not by an exited thread with the same id
+u32 is_own_access(ShadowAccess *slot, ThreadState *thread) {
+    return slot->thread_id == thread->thread_id && slot->memory_access_count > thread->start_count;
+}
+
+u32 accesses_overlap(MemoryAccess *a, ShadowAccess *b) {
+    return (a->byte_mask & b->byte_mask) != 0;
+}
 // util fns..
 
 
@@ -124,43 +214,81 @@ void mem_analyse_exit() {
     //     free(program_threads[j].mem_read_set);
     //     free(program_threads[j].lock_state_set);
     // }
-    printf("detected_races_counter: %ld, checked_but_ok_races_counter: %ld \n", detected_races_counter, checked_but_ok_races_counter);
+    printf("detected_races_counter: %ld, checked_but_ok_races_counter: %ld, suppressed_races_counter: %ld, retired threads: %ld \n", detected_races_counter, checked_but_ok_races_counter, suppressed_races_counter, n_retired_threads);
+    if (shadow_evictions > 0) printf("granule shadow full, evicted accesses: %ld \n", shadow_evictions);
+    if (dropped_sync_releases > 0) printf("sync variable table full, dropped releases: %ld \n", dropped_sync_releases);
 }
 
 u32 mem_analyse_init() { 
-        return 1;
+    // the retired threads summary owns the allocations of all exited threads
+    program_threads[RETIRED_THREADS_INDEX].thread_id = RETIRED_THREADS_ID;
+    program_threads[RETIRED_THREADS_INDEX].active = 1;
+    n_program_threads = RETIRED_THREADS_INDEX + 1;
+    return 1;
 }
 
 u32 mem_analyse_new_thread_init(void *drcontext) {
     if (drcontext == NULL) return 0;
     u64 thread_id = dr_get_thread_id(drcontext);
     // printf("init: %ld\n", thread_id);
-    if (n_program_threads >= MAX_THREADS) return 0;
-    program_threads[n_program_threads].thread_id = thread_id;
-
-    program_threads[n_program_threads].mem_read_set = (MemoryAccess*)malloc(sizeof(MemoryAccess) * linear_set_size_increment);
-    program_threads[n_program_threads].mem_read_set_capacity = linear_set_size_increment;
-    if (program_threads[n_program_threads].mem_read_set == NULL) {
-        printf("set allocation error \n");
-        return 0;    
+    pthread_mutex_lock(&mutex_program_threads);
+    // reuse the slot (and with it the thread index) of a retired thread if there is one
+    u64 slot;
+    for (slot = RETIRED_THREADS_INDEX + 1; slot < n_program_threads; slot++) {
+        if (!program_threads[slot].active) break;
     }
-    program_threads[n_program_threads].mem_write_set = (MemoryAccess*)malloc(sizeof(MemoryAccess) * linear_set_size_increment);
-    program_threads[n_program_threads].mem_write_set_capacity = linear_set_size_increment;
-    if (program_threads[n_program_threads].mem_write_set == NULL) {
-        printf("set allocation error \n");
+    if (slot >= MAX_THREADS) {
+        pthread_mutex_unlock(&mutex_program_threads);
         return 0;
     }
+    ThreadState *thread_state = &program_threads[slot];
+    memset(thread_state, 0, sizeof(ThreadState));
+    thread_state->thread_id = thread_id;
+    thread_state->active = 1;
+    // the thread starts like after a release, slots of an exited thread with the same id are never
+    // merged with its accesses (see shadow_insert)
+    thread_state->start_count = program_threads[RETIRED_THREADS_INDEX].clock;
+    thread_state->last_release_count = thread_state->start_count;
     // printf("new thread: %ld \n", thread_id);
-    n_program_threads += 1;
+    if (slot == n_program_threads) n_program_threads += 1;
+    pthread_mutex_unlock(&mutex_program_threads);
     return 1;
 }
 
-void mem_analyse_thread_exit() {
-    // printf("thread exit \n");
+// retires the exiting thread: the retired threads summary takes over its allocations and its slot
+// becomes reusable. its accesses stay in the granule shadow. the slot is freed under
+// mutex_program_threads, which memtrace holds while it uses the current threads state.
+// must be called after the threads trace buffer has been processed.
+void mem_analyse_thread_exit(void *drcontext) {
+    if (drcontext == NULL) return;
+    u64 thread_id = dr_get_thread_id(drcontext);
+
+    pthread_mutex_lock(&mutex_program_allocs);
+    u64 j;
+    for (j = 0; j < n_program_allocs; j++) {
+        if (program_allocations[j].callee_thread_id == thread_id) program_allocations[j].callee_thread_id = RETIRED_THREADS_ID;
+    }
+    pthread_mutex_unlock(&mutex_program_allocs);
+
+    pthread_mutex_lock(&mutex_program_threads);
+    i64 t_index = find_thread_by_tid(thread_id);
+    if (t_index <= RETIRED_THREADS_INDEX) {
+        pthread_mutex_unlock(&mutex_program_threads);
+        return;
+    }
+    ThreadState *exiting = &program_threads[t_index];
+    ThreadState *retired = &program_threads[RETIRED_THREADS_INDEX];
+    if (exiting->clock > retired->clock) retired->clock = exiting->clock;
+    memset(exiting, 0, sizeof(ThreadState));
+    n_retired_threads += 1;
+    pthread_mutex_unlock(&mutex_program_threads);
 }
 
 
 void wrap_pre_unlock(void *wrapcxt, OUT void **user_data) {
+    // trace buffers are only flushed when full, process the accesses buffered so far with the state they happened under
+    memtrace(dr_get_current_drcontext(), dr_get_thread_id(dr_get_current_drcontext()));
+    shrink_idle_trace_buf(dr_get_current_drcontext());
     void *addr = drwrap_get_arg(wrapcxt, 0);
     u64 thread_id = dr_get_thread_id(dr_get_current_drcontext());
     i64 t_index = find_thread_by_tid(thread_id);
@@ -196,6 +324,9 @@ void wrap_pre_unlock(void *wrapcxt, OUT void **user_data) {
 }
 // todo => handle post lock/unlock and check wether it was successfull!.
 void wrap_pre_lock(void *wrapcxt, OUT void **user_data) {
+    // trace buffers are only flushed when full, process the accesses buffered so far with the state they happened under
+    memtrace(dr_get_current_drcontext(), dr_get_thread_id(dr_get_current_drcontext()));
+    shrink_idle_trace_buf(dr_get_current_drcontext());
     // printf("pre LOCK\n");
     void *addr = drwrap_get_arg(wrapcxt, 0);
     // printf("locking: %ld \n", addr);
@@ -239,6 +370,10 @@ void wrap_pre_lock(void *wrapcxt, OUT void **user_data) {
 
 void wrap_post_malloc(void *wrapcxt, void *user_data) {
     size_t size = (size_t)user_data;
+    // filtered out by wrap_pre_malloc (zero sized allocations can't be accessed anyway)
+    if (size == 0) return;
+    // trace buffers are only flushed when full, process the accesses buffered so far with the state they happened under
+    memtrace(dr_get_current_drcontext(), dr_get_thread_id(dr_get_current_drcontext()));
     void *addr = drwrap_get_retval(wrapcxt);
     // must use dr_get_current_drcontext() instead of wrapcxt bc thread_id is corrupted otherwise
     u64 thread_id = dr_get_thread_id(dr_get_current_drcontext());
@@ -260,39 +395,205 @@ void wrap_post_malloc(void *wrapcxt, void *user_data) {
 }
 void wrap_pre_malloc(void *wrapcxt, OUT void **user_data) {
     size_t alloc_size = (size_t)drwrap_get_arg(wrapcxt, 0);
+    // only allocations passing the -watch_* filter are tracked
+    if (!watch_allocation(wrapcxt, alloc_size)) alloc_size = 0;
     *user_data = (void *)alloc_size;
 }
 
-void check_for_race(ThreadState *thread_state) {
-    int thread_i, write_set_i, write_set_i_plus1, read_set_i;
-    for (write_set_i = 0; write_set_i < thread_state->mem_write_set_len; write_set_i++) {
-        for (thread_i = 0; thread_i < n_program_threads; thread_i++) {
-            if (program_threads[thread_i].thread_id != thread_state->thread_id) continue;
-            ThreadState *iterated_thread = &program_threads[thread_i];
+void report_access_pair(RaceKind kind, MemoryAccess *access, ShadowAccess *other_access) {
+    RaceReport report = {
+        .kind = kind,
+        .address = access->address_accessed,
+        .size = access->size,
+        .pc = access->pc,
+        .other_pc = other_access->pc,
+        .opcode = access->opcode,
+        .other_opcode = other_access->opcode,
+        .thread_id = access->callee_thread_id,
+        .other_thread_id = other_access->thread_id,
+        .memory_access_count = access->memory_access_count,
+        .other_memory_access_count = other_access->memory_access_count,
+    };
+    report_race(&report);
+}
+
+// true if the earlier access is ordered before the later one by an acquire of a release
+// made by the earlier accesses thread. only the last acquire of a thread is tracked.
+u32 happens_before(ShadowAccess *earlier, MemoryAccess *later) {
+    return later->acquired_from_thread_id == earlier->thread_id && later->acquired_count >= earlier->memory_access_count;
+}
+
+// returns the slot of addr, or the free slot it would go to. NULL if addr isn't in the full table.
+SyncVar *find_sync_var(usize addr) {
+    u64 i = (addr >> 2) * 0x9e3779b97f4a7c15ULL >> 50 & (SYNC_VARS_SIZE - 1);
+    u64 probes;
+    for (probes = 0; probes < SYNC_VARS_SIZE; probes++) {
+        SyncVar *var = &program_sync_vars[i];
+        if (var->addr == addr || var->addr == 0) return var;
+        i = (i + 1) & (SYNC_VARS_SIZE - 1);
+    }
+    return NULL;
+}
+
+// sync accesses never enter the granule shadow, they only create happens-before edges
+void handle_sync_access(ThreadState *curr_thread, u64 thread_id, mem_ref_t *mem_ref) {
+    pthread_mutex_lock(&mutex_program_sync_vars);
+    SyncVar *var = find_sync_var((usize)mem_ref->addr);
+    if (mem_ref->type == REF_TYPE_SYNC_RELEASE) {
+        // keep one slot free so probing for a new address always terminates at an empty slot
+        if (var == NULL || (var->addr == 0 && n_program_sync_vars >= SYNC_VARS_SIZE - 1)) {
+            dropped_sync_releases += 1;
+            pthread_mutex_unlock(&mutex_program_sync_vars);
+            return;
+        }
+        if (var->addr == 0) {
+            var->addr = (usize)mem_ref->addr;
+            n_program_sync_vars += 1;
+        }
+        var->release_count = next_access_count();
+        var->releasing_thread_id = thread_id;
+        curr_thread->last_release_count = var->release_count;
+        curr_thread->clock = var->release_count;
+    } else if (var != NULL && var->addr != 0 && var->releasing_thread_id != thread_id) {
+        curr_thread->acquired_count = var->release_count;
+        curr_thread->acquired_from_thread_id = var->releasing_thread_id;
+    }
+    pthread_mutex_unlock(&mutex_program_sync_vars);
+}
+
+u64 granule_shadow_slot(GranuleShadow *table, u64 size, usize granule) {
+    u64 i = granule * 0x9e3779b97f4a7c15ULL >> 32 & (size - 1);
+    while (table[i].granule != 0 && table[i].granule != granule) i = (i + 1) & (size - 1);
+    return i;
+}
+
+void grow_granule_shadow() {
+    u64 size = granule_shadow_size == 0 ? GRANULE_SHADOW_INITIAL_SIZE : granule_shadow_size * 2;
+    GranuleShadow *table = calloc(size, sizeof(GranuleShadow));
+    u64 i;
+    if (table == NULL) exit(1);
+    for (i = 0; i < granule_shadow_size; i++) {
+        if (granule_shadow[i].granule == 0) continue;
+        table[granule_shadow_slot(table, size, granule_shadow[i].granule)] = granule_shadow[i];
+    }
+    free(granule_shadow);
+    granule_shadow = table;
+    granule_shadow_size = size;
+}
+
+GranuleShadow *find_granule_shadow(usize granule) {
+    if ((n_granule_shadows + 1) * 4 > granule_shadow_size * 3) grow_granule_shadow();
+    GranuleShadow *shadow = &granule_shadow[granule_shadow_slot(granule_shadow, granule_shadow_size, granule)];
+    if (shadow->granule == 0) {
+        shadow->granule = granule;
+        n_granule_shadows += 1;
+    }
+    return shadow;
+}
+
+// returns 1 and reports the pair unless it's suppressed
+u32 report_if_not_suppressed(RaceKind kind, MemoryAccess *access, ShadowAccess *other_access) {
+    if (race_is_suppressed((app_pc)access->pc, (app_pc)other_access->pc)) {
+        suppressed_races_counter += 1;
+        return 0;
+    }
+    detected_races_counter += 1;
+    report_access_pair(kind, access, other_access);
+    return 1;
+}
+
+// stores the access in a slot of its granule. a slot of the same thread and kind is extended if
+// no release of the thread lies between the two (last_release_count), an acquire can't order one
+// of them without the other then. otherwise a free slot is taken, or the oldest one is evicted.
+void shadow_insert(GranuleShadow *shadow, MemoryAccess *access, u32 is_write, ThreadState *thread) {
+    ShadowAccess *slot = NULL;
+    u32 i;
+    for (i = 0; i < SHADOW_SLOTS; i++) {
+        ShadowAccess *s = &shadow->slots[i];
+        if (s->byte_mask != 0 && s->thread_id == access->callee_thread_id && s->is_write == is_write &&
+            s->lock_state == access->lock_access.state && s->memory_access_count > thread->last_release_count) {
+            access->byte_mask |= s->byte_mask;
+            slot = s;
+            break;
+        }
+        if (slot == NULL && s->byte_mask == 0) slot = s;
+    }
+    if (slot == NULL) {
+        slot = &shadow->slots[0];
+        for (i = 1; i < SHADOW_SLOTS; i++) {
+            if (shadow->slots[i].memory_access_count < slot->memory_access_count) slot = &shadow->slots[i];
+        }
+        shadow_evictions += 1;
+    }
+    slot->thread_id = access->callee_thread_id;
+    slot->memory_access_count = access->memory_access_count;
+    slot->pc = access->pc;
+    slot->opcode = access->opcode;
+    slot->byte_mask = access->byte_mask;
+    slot->is_write = is_write;
+    slot->lock_state = access->lock_access.state;
+}
+
+// checks a new access against the slots of its granule and stores it. like the scan over the sets
+// it replaces, writes are checked against earlier reads and writes, reads only get recorded. a race
+// is reported once per kind and write, then the write takes over the bytes it wrote.
+void check_for_race(MemoryAccess *access, u32 is_write, ThreadState *thread) {
+    GranuleShadow *shadow = find_granule_shadow(access->granule);
+    u32 i;
+    if (is_write) {
+        u32 reported_write_read = 0, reported_write_write = 0;
+        for (i = 0; i < SHADOW_SLOTS; i++) {
+            ShadowAccess *other = &shadow->slots[i];
+            if (is_own_access(other, thread) || !accesses_overlap(access, other) || happens_before(other, access)) continue;
             // check write-read pairs
-            for (read_set_i = 0; read_set_i < iterated_thread->mem_read_set_len; read_set_i++) {
-                if (thread_state->mem_write_set[write_set_i].address_accessed == iterated_thread->mem_read_set[read_set_i].address_accessed) {
-                    if (thread_state->mem_write_set[write_set_i].memory_access_count > iterated_thread->mem_read_set[read_set_i].memory_access_count) {
-                        if(thread_state->mem_write_set[write_set_i].lock_access.state != WriteHeld && iterated_thread->mem_read_set[read_set_i].lock_access.state != ReadHeld) {
-                            detected_races_counter += 1;
-                            break;
-                        }
-                    }
-                }
-            }   
-            // write write-read pairs
-            for (write_set_i_plus1 = 0; write_set_i_plus1 < iterated_thread->mem_write_set_len; write_set_i_plus1++) {
-                if (thread_state->mem_write_set[write_set_i].address_accessed == iterated_thread->mem_write_set[write_set_i_plus1].address_accessed) {
-                    if(thread_state->mem_write_set[write_set_i].lock_access.state != WriteHeld && iterated_thread->mem_write_set[write_set_i_plus1].lock_access.state != WriteHeld) {
-                        detected_races_counter += 1;
-                        break;
-                    }
-                }
-            
-            }   
+            if (!other->is_write && !reported_write_read && access->lock_access.state != WriteHeld && other->lock_state != ReadHeld) {
+                reported_write_read = report_if_not_suppressed(WriteReadRace, access, other);
+            }
+            // check write-write pairs
+            if (other->is_write && !reported_write_write && access->lock_access.state != WriteHeld && other->lock_state != WriteHeld) {
+                reported_write_write = report_if_not_suppressed(WriteWriteRace, access, other);
+            }
         }
         checked_but_ok_races_counter += 1;
     }
+    // a write replaces every earlier access to its bytes, a read only the earlier reads of its thread
+    for (i = 0; i < SHADOW_SLOTS; i++) {
+        ShadowAccess *other = &shadow->slots[i];
+        if (is_write || (!other->is_write && is_own_access(other, thread))) {
+            other->byte_mask &= ~access->byte_mask;
+        }
+    }
+    shadow_insert(shadow, access, is_write, thread);
+}
+
+// checks every granule touched by mem_ref against the granule shadow. the accesses themselves
+// aren't kept anywhere else, the shadow is all the detector needs.
+void check_access(ThreadState *curr_thread, u64 thread_id, mem_ref_t *mem_ref, u64 access_count, app_pc pc, u16 opcode, i32 lock_state_i) {
+    usize addr = (usize)mem_ref->addr;
+    usize end = addr + (mem_ref->size > 0 ? mem_ref->size : 1);
+    MemoryAccess access;
+    while (addr < end) {
+        usize granule_end = (addr & ~(usize)(GRANULE_SIZE - 1)) + GRANULE_SIZE;
+        usize piece_end = end < granule_end ? end : granule_end;
+        memset(&access, 0, sizeof(MemoryAccess));
+        access.address_accessed = addr;
+        access.granule = addr >> GRANULE_SHIFT;
+        access.byte_mask = (u8)(((1u << (piece_end - addr)) - 1) << (addr & (GRANULE_SIZE - 1)));
+        access.pc = (usize)pc;
+        access.opcode = opcode;
+        access.callee_thread_id = thread_id;
+        access.size = mem_ref->size;
+        access.memory_access_count = access_count;
+        access.acquired_count = curr_thread->acquired_count;
+        access.acquired_from_thread_id = curr_thread->acquired_from_thread_id;
+        if (lock_state_i != -1) {
+            LockAccess la = {program_locks[lock_state_i].state, program_locks[lock_state_i].addr, program_locks[lock_state_i].callee_thread_id};
+            access.lock_access = la;
+            access.has_lock = 1;
+        }
+        check_for_race(&access, mem_ref->type == REF_TYPE_WRITE, curr_thread);
+        addr = piece_end;
+    }
 }
 
 // this is an event like fn that is envoked on every memory access (called by DynamRIO)
@@ -306,9 +607,28 @@ void memtrace(void *drcontext, u64 thread_id) {
     // todo => fix: mutex information is loaded from wrong thread. it's loaded from the last_locked_mutex_addr from the thread_accessed(the thread to which or from which the information is written/read) instead in which thread it took place.
     i64 curr_thread_index = find_thread_by_tid(thread_id);
     if (curr_thread_index < 0) return;    
+    // instruction entries (type = opcode) precede the memory reference entries of their instruction
+    app_pc curr_pc = NULL;
+    u16 curr_opcode = 0;
     for (mem_ref = (mem_ref_t *)data->buf_base; mem_ref < buf_ptr; mem_ref++) {
         int j;
 
+        if (mem_ref->type != REF_TYPE_READ && mem_ref->type != REF_TYPE_WRITE && mem_ref->type != REF_TYPE_SYNC_ACQUIRE && mem_ref->type != REF_TYPE_SYNC_RELEASE) {
+            curr_pc = mem_ref->addr;
+            curr_opcode = mem_ref->type;
+            data->num_refs++;
+            continue;
+        }
+
+        // atomics only carry happens-before edges and skip the access-check path. they are kept for
+        // any address, a global flag often guards heap data. the -only_* scope limits which of them
+        // are instrumented at all
+        if (mem_ref->type == REF_TYPE_SYNC_ACQUIRE || mem_ref->type == REF_TYPE_SYNC_RELEASE) {
+            handle_sync_access(&program_threads[curr_thread_index], thread_id, mem_ref);
+            data->num_refs++;
+            continue;
+        }
+
         // no program_allocations, no mem shared
         if (n_program_allocs <= 0) {
             data->num_refs++;
@@ -323,19 +643,12 @@ void memtrace(void *drcontext, u64 thread_id) {
                 goto continue_outer_loop;
             }
         }
-        memory_access_counter++;
-        if (memory_access_counter >= LLONG_MAX) DR_ASSERT(false);
-        u64 thread_id_owning_accessed_addr = program_allocations[j].callee_thread_id;
-
-        i64 thread_states_index_owning_accessed_addr = find_thread_by_tid(thread_id_owning_accessed_addr);
-        if (thread_states_index_owning_accessed_addr < 0) {
-            printf("error finding thread_id. %ld \n", thread_id);
-            BUF_PTR(data->seg_base) = data->buf_base;
-            return;    
-        }
-        ThreadState *thread_accessed = &program_threads[thread_states_index_owning_accessed_addr];
-        ThreadState *curr_thread = &program_threads[curr_thread_index];
+        u64 access_count = next_access_count();
+        // the shadow and the current threads state are only used under the lock, an exiting thread
+        // frees its slot under the same lock
         pthread_mutex_lock(&mutex_program_threads);
+        ThreadState *curr_thread = &program_threads[curr_thread_index];
+        if (access_count > curr_thread->clock) curr_thread->clock = access_count;
         i32 lock_state_i;
         if (curr_thread->last_locked_mutex_addr != -1) {
             for (lock_state_i = 0; lock_state_i <= n_program_locks; lock_state_i++) {
@@ -347,40 +660,10 @@ void memtrace(void *drcontext, u64 thread_id) {
         } else {
             lock_state_i = curr_thread->last_locked_mutex_addr;
         }
-        if (mem_ref->type == 1 || mem_ref->type == 457 || mem_ref->type == 458 || mem_ref->type == 456 || mem_ref->type == 568) {
-            // mem write
-            if (thread_accessed->mem_write_set_len >= thread_accessed->mem_write_set_capacity) thread_accessed->mem_write_set = increase_set_capacity(thread_accessed->mem_write_set, &thread_accessed->mem_write_set_capacity);
-            if (thread_accessed->mem_write_set == NULL) exit(1);
-            thread_accessed->mem_write_set[thread_accessed->mem_write_set_len].address_accessed = (usize)mem_ref->addr;
-            thread_accessed->mem_write_set[thread_accessed->mem_write_set_len].opcode = mem_ref->type;
-            thread_accessed->mem_write_set[thread_accessed->mem_write_set_len].callee_thread_id = thread_id;
-            thread_accessed->mem_write_set[thread_accessed->mem_write_set_len].size = mem_ref->size;
-            thread_accessed->mem_write_set[thread_accessed->mem_write_set_len].memory_access_count = memory_access_counter;
-            if (lock_state_i != -1) {
-                LockAccess la = {program_locks[lock_state_i].state, program_locks[lock_state_i].addr, program_locks[lock_state_i].callee_thread_id};
-                thread_accessed->mem_write_set[thread_accessed->mem_write_set_len].lock_access = la;
-                thread_accessed->mem_write_set[thread_accessed->mem_write_set_len].has_lock = 1;
-            }
-            thread_accessed->mem_write_set_len += 1;
-        } else if(mem_ref->type == 0 || mem_ref->type == 227 || mem_ref->type == 225 || mem_ref->type == 197 || mem_ref->type == 228 || mem_ref->type == 229 || mem_ref->type == 299 || mem_ref->type == 173) {
-            // mem read
-            if (thread_accessed->mem_read_set_len >= thread_accessed->mem_read_set_capacity) thread_accessed->mem_read_set = increase_set_capacity(thread_accessed->mem_read_set, &thread_accessed->mem_read_set_capacity);
-            if (thread_accessed->mem_read_set == NULL) exit(1);
-            thread_accessed->mem_read_set[thread_accessed->mem_read_set_len].address_accessed = (usize)mem_ref->addr;
-            thread_accessed->mem_read_set[thread_accessed->mem_read_set_len].opcode = mem_ref->type;
-            thread_accessed->mem_read_set[thread_accessed->mem_read_set_len].callee_thread_id = thread_id;
-            thread_accessed->mem_read_set[thread_accessed->mem_read_set_len].size = mem_ref->size;
-            thread_accessed->mem_read_set[thread_accessed->mem_read_set_len].memory_access_count = memory_access_counter;
-            if (lock_state_i != -1) {
-                LockAccess la = {program_locks[lock_state_i].state, program_locks[lock_state_i].addr, program_locks[lock_state_i].callee_thread_id};
-                thread_accessed->mem_read_set[thread_accessed->mem_read_set_len].lock_access = la;
-                thread_accessed->mem_read_set[thread_accessed->mem_read_set_len].has_lock = 1;
-            }
-            thread_accessed->mem_read_set_len += 1;
-        }
+        // reads and writes are classified at instrumentation time, independent of the architecture
+        check_access(curr_thread, thread_id, mem_ref, access_count, curr_pc, curr_opcode, lock_state_i);
 
         pthread_mutex_unlock(&mutex_program_threads);
-        check_for_race(thread_accessed);
         continue_outer_loop:;
         data->num_refs++;
     }
@@ -0,0 +1,153 @@
+#include "include/instrument.h"
+
+// Race reports are passed from the detecting (app) threads to a dedicated client thread
+// through a bounded lock free queue (Vyukov's MPMC ring, used with a single consumer). App
+// threads never block on I/O or formatting, if the queue is full the report is dropped and
+// counted instead.
+#define REPORT_QUEUE_SIZE 16384 // must be a power of 2
+#define REPORT_WRITE_BUF_SIZE 65536
+#define REPORT_MAX_LINE_LEN 1024
+#define REPORT_POLL_INTERVAL_MS 10
+#define REPORT_EXIT_TIMEOUT_MS 100
+
+typedef struct ReportSlot {
+    u64 sequence;
+    RaceReport report;
+} ReportSlot;
+
+static ReportSlot report_queue[REPORT_QUEUE_SIZE];
+static u64 report_enqueue_pos = 0;
+static u64 report_dequeue_pos = 0;
+static u64 dropped_reports = 0;
+static u64 written_reports = 0;
+// set by report_exit, a still running writer thread leaves its loop after the current drain
+static volatile bool report_writer_stop = false;
+
+static file_t report_file = INVALID_FILE;
+// only serializes the writer thread and the final drain in report_exit, app threads never take it
+static void *report_consumer_mutex;
+static char report_write_buf[REPORT_WRITE_BUF_SIZE];
+static usize report_write_buf_len = 0;
+
+static void flush_write_buf() {
+    if (report_write_buf_len == 0) return;
+    dr_write_file(report_file, report_write_buf, report_write_buf_len);
+    report_write_buf_len = 0;
+}
+
+// formats pc as <module>+<offset>, the form used by race suppression rules
+static void format_pc(u64 pc, char *buf, usize buf_size) {
+    module_data_t *mod = dr_lookup_module((app_pc)pc);
+    if (mod == NULL) {
+        dr_snprintf(buf, buf_size, "0x%llx", pc);
+    } else {
+        dr_snprintf(buf, buf_size, "%s+0x%llx", dr_module_preferred_name(mod), pc - (u64)mod->start);
+        dr_free_module_data(mod);
+    }
+    buf[buf_size - 1] = '\0';
+}
+
+static void format_report(const RaceReport *report) {
+    char line[REPORT_MAX_LINE_LEN];
+    char pc[MAXIMUM_PATH], other_pc[MAXIMUM_PATH];
+    format_pc(report->pc, pc, sizeof(pc));
+    format_pc(report->other_pc, other_pc, sizeof(other_pc));
+    int len = dr_snprintf(line, sizeof(line),
+        "{\"kind\":\"%s\",\"address\":\"0x%llx\",\"size\":%llu,\"pc\":\"%s\",\"other_pc\":\"%s\",\"opcode\":%u,\"other_opcode\":%u,"
+        "\"thread_id\":%llu,\"other_thread_id\":%llu,\"access_count\":%llu,\"other_access_count\":%llu}\n",
+        report->kind == WriteWriteRace ? "write-write" : "write-read",
+        report->address, report->size, pc, other_pc, report->opcode, report->other_opcode,
+        report->thread_id, report->other_thread_id,
+        report->memory_access_count, report->other_memory_access_count);
+    if (len < 0) len = sizeof(line) - 1; // truncated
+    if (report_write_buf_len + len > REPORT_WRITE_BUF_SIZE) flush_write_buf();
+    memcpy(report_write_buf + report_write_buf_len, line, len);
+    report_write_buf_len += len;
+}
+
+// single consumer, returns the number of reports written
+static u64 drain_report_queue() {
+    u64 n = 0;
+    for (;;) {
+        ReportSlot *slot = &report_queue[report_dequeue_pos & (REPORT_QUEUE_SIZE - 1)];
+        u64 sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence != report_dequeue_pos + 1) break; // empty
+        format_report(&slot->report);
+        // hand the slot back to the producers for the next lap
+        __atomic_store_n(&slot->sequence, report_dequeue_pos + REPORT_QUEUE_SIZE, __ATOMIC_RELEASE);
+        report_dequeue_pos++;
+        n++;
+    }
+    flush_write_buf();
+    written_reports += n;
+    return n;
+}
+
+static void report_writer_thread(void *arg) {
+    while (!report_writer_stop) {
+        dr_mutex_lock(report_consumer_mutex);
+        u64 n = drain_report_queue();
+        dr_mutex_unlock(report_consumer_mutex);
+        if (n == 0) dr_sleep(REPORT_POLL_INTERVAL_MS);
+    }
+}
+
+bool report_init(const char *path) {
+    u64 i;
+    if (path == NULL) return true; // reporting disabled
+    report_file = dr_open_file(path, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    if (report_file == INVALID_FILE) {
+        dr_fprintf(STDERR, "unable to open report file %s\n", path);
+        return false;
+    }
+    for (i = 0; i < REPORT_QUEUE_SIZE; i++) report_queue[i].sequence = i;
+    report_consumer_mutex = dr_mutex_create();
+    return dr_create_client_thread(report_writer_thread, NULL);
+}
+
+void report_exit() {
+    u64 waited_ms = 0;
+    bool locked;
+    if (report_file == INVALID_FILE) return;
+    // stop the writer so the final drain below is the only consumer left
+    report_writer_stop = true;
+    // the writer thread may have been suspended while holding the mutex, only wait a bit for it
+    while (!(locked = dr_mutex_trylock(report_consumer_mutex)) && waited_ms < REPORT_EXIT_TIMEOUT_MS) {
+        dr_sleep(REPORT_POLL_INTERVAL_MS);
+        waited_ms += REPORT_POLL_INTERVAL_MS;
+    }
+    if (locked) {
+        drain_report_queue();
+        dr_mutex_unlock(report_consumer_mutex);
+    } else {
+        // whatever is still queued won't be written, count it so the summary adds up
+        dropped_reports += __atomic_load_n(&report_enqueue_pos, __ATOMIC_ACQUIRE) - report_dequeue_pos;
+    }
+    dr_fprintf(STDERR, "race reports written: %llu, dropped: %llu\n", written_reports, dropped_reports);
+    dr_close_file(report_file);
+    report_file = INVALID_FILE;
+}
+
+// called from the detecting thread, never blocks
+void report_race(const RaceReport *report) {
+    if (report_file == INVALID_FILE) return;
+    u64 pos = __atomic_load_n(&report_enqueue_pos, __ATOMIC_RELAXED);
+    ReportSlot *slot;
+    for (;;) {
+        slot = &report_queue[pos & (REPORT_QUEUE_SIZE - 1)];
+        u64 sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        i64 diff = (i64)sequence - (i64)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&report_enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+            // pos was reloaded by the failed exchange
+        } else if (diff < 0) {
+            // full, the writer thread can't keep up
+            __atomic_add_fetch(&dropped_reports, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&report_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    slot->report = *report;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,241 @@
+#include "include/instrument.h"
+#include <sys/stat.h>
+#include <link.h>
+
+// On disk cache of the module offsets of all wrapped symbols. Looking them up with drsyms
+// means loading the debug info of every module, which takes long for big binaries. There is
+// one cache file per module, named after the hash of its path, and it's only used if the
+// module's build id, mtime and size and the looked up symbol names match.
+// A second file per module holds the code ranges computed from a set of rules (the functions
+// matched by file suppressions), which otherwise need a walk over the module's line table.
+#define SYMCACHE_MAGIC 0x6568636143737962ULL
+#define SYMCACHE_RANGES_MAGIC 0x65676e6152737962ULL
+#define SYMCACHE_VERSION 1
+#define SYMCACHE_MAX_SYMBOLS 32
+#define SYMCACHE_MAX_BUILD_ID 64
+
+typedef struct SymbolCacheKey {
+    char path[MAXIMUM_PATH];
+    u64 mtime;
+    u64 file_size;
+    u32 build_id_len;
+    u8 build_id[SYMCACHE_MAX_BUILD_ID];
+    // hash of the looked up names, a changed wrap set invalidates the entry
+    u64 names_hash;
+    u32 n_names;
+} SymbolCacheKey;
+
+typedef struct SymbolCacheFile {
+    u64 magic;
+    u32 version;
+    SymbolCacheKey key;
+    size_t offsets[SYMCACHE_MAX_SYMBOLS];
+} SymbolCacheFile;
+
+// followed by n_ranges pairs of module offsets
+typedef struct SymbolCacheRangesFile {
+    u64 magic;
+    u32 version;
+    SymbolCacheKey key;
+    u64 n_ranges;
+} SymbolCacheRangesFile;
+
+static char symcache_dir[MAXIMUM_PATH];
+static bool symcache_enabled = false;
+static u64 symcache_hits = 0;
+static u64 symcache_misses = 0;
+
+static u64 fnv1a(u64 hash, const void *data, usize len) {
+    const u8 *bytes = data;
+    usize i;
+    for (i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// reads the GNU build id note from the mapped ELF headers of the module
+static u32 read_build_id(const module_data_t *mod, u8 *build_id) {
+    const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *)mod->start;
+    const ElfW(Phdr) *phdr;
+    usize load_bias = 0;
+    bool found_load = false;
+    int i;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) return 0;
+    phdr = (const ElfW(Phdr) *)(mod->start + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && !found_load) {
+            load_bias = (usize)mod->start - (phdr[i].p_vaddr & ~(phdr[i].p_align - 1));
+            found_load = true;
+        }
+    }
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdr[i].p_type != PT_NOTE) continue;
+        const u8 *note = (const u8 *)(load_bias + phdr[i].p_vaddr);
+        const u8 *end = note + phdr[i].p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+            const u8 *name = note + sizeof(ElfW(Nhdr));
+            const u8 *desc = name + ALIGN_FORWARD(nhdr->n_namesz, 4);
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0 &&
+                nhdr->n_descsz <= SYMCACHE_MAX_BUILD_ID) {
+                memcpy(build_id, desc, nhdr->n_descsz);
+                return nhdr->n_descsz;
+            }
+            note = desc + ALIGN_FORWARD(nhdr->n_descsz, 4);
+        }
+    }
+    return 0;
+}
+
+static bool make_key(const module_data_t *mod, const char **names, u32 n_names, SymbolCacheKey *key) {
+    struct stat st;
+    u32 i;
+    if (strlen(mod->full_path) >= MAXIMUM_PATH) return false;
+    if (stat(mod->full_path, &st) != 0) return false;
+    memset(key, 0, sizeof(SymbolCacheKey));
+    strncpy(key->path, mod->full_path, MAXIMUM_PATH - 1);
+    key->mtime = (u64)st.st_mtime;
+    key->file_size = (u64)st.st_size;
+    key->build_id_len = read_build_id(mod, key->build_id);
+    key->names_hash = 0xcbf29ce484222325ULL;
+    for (i = 0; i < n_names; i++) key->names_hash = fnv1a(key->names_hash, names[i], strlen(names[i]) + 1);
+    key->n_names = n_names;
+    return true;
+}
+
+static void cache_file_path(const SymbolCacheKey *key, const char *suffix, char *path, usize path_size) {
+    u64 hash = fnv1a(0xcbf29ce484222325ULL, key->path, strlen(key->path));
+    dr_snprintf(path, path_size, "%s/%016llx.%s", symcache_dir, hash, suffix);
+    path[path_size - 1] = '\0';
+}
+
+// memory maps the cache file and copies the offsets out if the file matches the key
+static bool read_cache_file(const char *path, const SymbolCacheKey *key, size_t *offsets) {
+    file_t f = dr_open_file(path, DR_FILE_READ);
+    size_t map_size = sizeof(SymbolCacheFile);
+    bool ok = false;
+    if (f == INVALID_FILE) return false;
+    uint64 file_size;
+    if (dr_file_size(f, &file_size) && file_size == sizeof(SymbolCacheFile)) {
+        const SymbolCacheFile *cached = dr_map_file(f, &map_size, 0, NULL, DR_MEMPROT_READ, 0);
+        if (cached != NULL) {
+            if (map_size >= sizeof(SymbolCacheFile) && cached->magic == SYMCACHE_MAGIC &&
+                cached->version == SYMCACHE_VERSION && memcmp(&cached->key, key, sizeof(SymbolCacheKey)) == 0) {
+                memcpy(offsets, cached->offsets, key->n_names * sizeof(size_t));
+                ok = true;
+            }
+            dr_unmap_file((void *)cached, map_size);
+        }
+    }
+    dr_close_file(f);
+    return ok;
+}
+
+// writes header and data to a temporary file first so concurrent runs never see half written entries
+static void write_cache_file_atomic(const char *path, const void *header, usize header_size, const void *data, usize data_size) {
+    char tmp_path[MAXIMUM_PATH];
+    dr_snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, dr_get_process_id());
+    tmp_path[sizeof(tmp_path) - 1] = '\0';
+    file_t f = dr_open_file(tmp_path, DR_FILE_WRITE_OVERWRITE);
+    if (f == INVALID_FILE) return;
+    bool written = dr_write_file(f, header, header_size) == header_size &&
+        (data_size == 0 || dr_write_file(f, data, data_size) == data_size);
+    dr_close_file(f);
+    if (!written || !dr_rename_file(tmp_path, path, true)) dr_delete_file(tmp_path);
+}
+
+static void write_cache_file(const char *path, const SymbolCacheKey *key, const size_t *offsets) {
+    SymbolCacheFile entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.magic = SYMCACHE_MAGIC;
+    entry.version = SYMCACHE_VERSION;
+    entry.key = *key;
+    memcpy(entry.offsets, offsets, key->n_names * sizeof(size_t));
+    write_cache_file_atomic(path, &entry, sizeof(entry), NULL, 0);
+}
+
+bool symcache_init(const char *dir) {
+    if (dir == NULL) return true; // caching disabled
+    if (strlen(dir) >= MAXIMUM_PATH - 64) return false;
+    strncpy(symcache_dir, dir, MAXIMUM_PATH - 1);
+    if (!dr_directory_exists(symcache_dir) && !dr_create_dir(symcache_dir)) {
+        dr_fprintf(STDERR, "unable to create symbol cache dir %s\n", symcache_dir);
+        return false;
+    }
+    symcache_enabled = true;
+    return true;
+}
+
+void symcache_exit() {
+    if (!symcache_enabled) return;
+    dr_fprintf(STDERR, "symbol cache hits: %llu, misses: %llu\n", symcache_hits, symcache_misses);
+}
+
+void symcache_lookup(const module_data_t *mod, const char **names, u32 n_names, size_t *offsets) {
+    SymbolCacheKey key;
+    char path[MAXIMUM_PATH];
+    bool cacheable = symcache_enabled && n_names <= SYMCACHE_MAX_SYMBOLS && make_key(mod, names, n_names, &key);
+    u32 i;
+    if (cacheable) {
+        cache_file_path(&key, "symcache", path, sizeof(path));
+        if (read_cache_file(path, &key, offsets)) {
+            dr_atomic_add64_return_sum((int64 *)&symcache_hits, 1);
+            return;
+        }
+    }
+    for (i = 0; i < n_names; i++) {
+        if (drsym_lookup_symbol(mod->full_path, names[i], &offsets[i], DRSYM_DEMANGLE) != DRSYM_SUCCESS)
+            offsets[i] = SYMCACHE_NOT_FOUND;
+    }
+    if (cacheable) {
+        dr_atomic_add64_return_sum((int64 *)&symcache_misses, 1);
+        write_cache_file(path, &key, offsets);
+    }
+}
+
+bool symcache_load_ranges(const module_data_t *mod, const char **rules, u32 n_rules, void (*add)(size_t start, size_t end, void *data), void *data) {
+    SymbolCacheKey key;
+    char path[MAXIMUM_PATH];
+    uint64 file_size;
+    u64 i;
+    bool ok = false;
+    if (!symcache_enabled || !make_key(mod, rules, n_rules, &key)) return false;
+    cache_file_path(&key, "ranges", path, sizeof(path));
+    file_t f = dr_open_file(path, DR_FILE_READ);
+    if (f == INVALID_FILE) {
+        dr_atomic_add64_return_sum((int64 *)&symcache_misses, 1);
+        return false;
+    }
+    if (dr_file_size(f, &file_size) && file_size >= sizeof(SymbolCacheRangesFile)) {
+        size_t map_size = (size_t)file_size;
+        const SymbolCacheRangesFile *cached = dr_map_file(f, &map_size, 0, NULL, DR_MEMPROT_READ, 0);
+        if (cached != NULL) {
+            if (map_size >= file_size && cached->magic == SYMCACHE_RANGES_MAGIC && cached->version == SYMCACHE_VERSION &&
+                memcmp(&cached->key, &key, sizeof(SymbolCacheKey)) == 0 &&
+                file_size == sizeof(SymbolCacheRangesFile) + cached->n_ranges * 2 * sizeof(size_t)) {
+                const size_t *ranges = (const size_t *)(cached + 1);
+                for (i = 0; i < cached->n_ranges; i++) add(ranges[2 * i], ranges[2 * i + 1], data);
+                ok = true;
+            }
+            dr_unmap_file((void *)cached, map_size);
+        }
+    }
+    dr_close_file(f);
+    dr_atomic_add64_return_sum((int64 *)(ok ? &symcache_hits : &symcache_misses), 1);
+    return ok;
+}
+
+void symcache_store_ranges(const module_data_t *mod, const char **rules, u32 n_rules, const size_t *ranges, u64 n_ranges) {
+    SymbolCacheRangesFile header;
+    char path[MAXIMUM_PATH];
+    if (!symcache_enabled) return;
+    memset(&header, 0, sizeof(header));
+    if (!make_key(mod, rules, n_rules, &header.key)) return;
+    header.magic = SYMCACHE_RANGES_MAGIC;
+    header.version = SYMCACHE_VERSION;
+    header.n_ranges = n_ranges;
+    cache_file_path(&header.key, "ranges", path, sizeof(path));
+    write_cache_file_atomic(path, &header, sizeof(header), ranges, n_ranges * 2 * sizeof(size_t));
+}
@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// accesses of different widths to the same 8 byte granules, none of them synchronized.
+// expected races (reads are only checked by a later write, so which ones show up depends on the
+// interleaving):
+//   - the u64 write of the writer against the u8 read of byte 3 by the reader (write-read)
+//   - the 16 byte memcpy of the copier against the u64 write (write-write, bytes 0-7)
+//   - the u16 write at offset 10 of the writer against the memcpy (write-write, bytes 10-11)
+// expected no race:
+//   - the u32 writes at offsets 16 and 20, they share a granule but no bytes
+volatile uint8_t *heap_storage;
+
+void *detector_malloc(size_t size) {
+	return malloc(size);
+}
+
+void *writer(void *arg) {
+	*(volatile uint64_t *)(heap_storage + 0) = 0x1122334455667788;
+	*(volatile uint16_t *)(heap_storage + 10) = 0xabcd;
+	*(volatile uint32_t *)(heap_storage + 16) = 1;
+	return NULL;
+}
+
+void *reader(void *arg) {
+	printf("byte 3: %d \n", heap_storage[3]);
+	*(volatile uint32_t *)(heap_storage + 20) = 2;
+	return NULL;
+}
+
+void *copier(void *arg) {
+	uint8_t src[16] = {0};
+	memcpy((void *)heap_storage, src, sizeof(src));
+	return NULL;
+}
+
+int main() {
+	int i;
+	pthread_t tid;
+
+	heap_storage = detector_malloc(64);
+
+	pthread_create(&tid, NULL, writer, NULL);
+	pthread_create(&tid, NULL, reader, NULL);
+	pthread_create(&tid, NULL, copier, NULL);
+
+	// insures that the program doesn't quit before the threads didn't end
+	// pthread_joind confuses Dynamorio and wait syscalls get blocked so this is an ugly solution
+	for (i = 0; i <= 10000000; i++) {}
+	return 0;
+}